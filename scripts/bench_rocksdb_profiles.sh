@@ -0,0 +1,77 @@
+#! /usr/bin/env bash
+#
+# Compares the svr --rocksdb-profile tunings. For every profile a fresh DB
+# gets KEYS keys written twice (the second round overwrites them, which is
+# what flushes and compactions have to rewrite), then svr restarts with a
+# cold KvStore and reads them back:
+#  - write amp: the ROCKSDB stats line svr prints on SIGUSR1 after the
+#               writes, once the memtables are flushed and the compactions
+#               done
+#  - GET hit:   LOOKUPS random keys that exist, one in flight at a time
+#  - GET miss:  LOOKUPS keys that were never written (bloom filters)
+#
+# usage: scripts/bench_rocksdb_profiles.sh [BUILD_DIR] [KEYS] [VALUE_SIZE] [LOOKUPS]
+
+set -u
+
+BUILD_DIR=$(realpath "${1:-build/dev}")
+KEYS=${2:-500000}
+VALUE_SIZE=${3:-400}
+LOOKUPS=${4:-50000}
+PROFILES=(default point-lookup write-heavy memory-constrained)
+MASTER_PORT=2095
+PORT=2096
+
+VALUE=$(head -c "$VALUE_SIZE" /dev/zero | tr '\0' 'v')
+WORK_DIR=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; rm -rf "$WORK_DIR"' EXIT
+
+# waits until svr, which may replay a big WAL first, listens
+start_svr() {
+	"$BUILD_DIR/svr" -p $PORT -m $MASTER_PORT --rocksdb-profile "$1" >"$WORK_DIR/svr.log" 2>&1 &
+	SVR_PID=$!
+	until (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null; do
+		sleep 0.5
+	done
+	sleep 1
+}
+
+stop_svr() {
+	kill $SVR_PID
+	wait $SVR_PID 2>/dev/null
+}
+
+clt() {
+	"$BUILD_DIR/clt" -m $MASTER_PORT -p $PORT -d 1 -v "$VALUE" "$@"
+}
+
+cd "$WORK_DIR" || exit 1
+"$BUILD_DIR/master-svr" -p $MASTER_PORT >master.log 2>&1 &
+sleep 1
+
+printf "%-20s %10s %14s %14s %14s %14s\n" profile "write amp" "GET hit p50" "GET hit p99" "GET miss p50" "GET miss p99"
+for profile in "${PROFILES[@]}"; do
+	rm -rf rockDBs
+	mkdir -p rockDBs/sub_DB_0
+
+	start_svr "$profile"
+	for round in 1 2; do
+		clt -o PUT -k 0 -n "$KEYS" -w 64 -b 16 >/dev/null
+	done
+	kill -USR1 $SVR_PID
+	until grep -q SETTLED svr.log; do
+		sleep 1
+	done
+	write_amp=$(grep -o "write amp [0-9.]*" svr.log | tail -1 | cut -d' ' -f3)
+	stop_svr
+
+	start_svr "$profile"
+	hit=$(clt -o GET -k 0 -n "$LOOKUPS" -r -l | grep LATENCY)
+	miss=$(clt -o GET -k "$KEYS" -n "$LOOKUPS" -r -l | grep LATENCY)
+	stop_svr
+
+	p50() { echo "$1" | sed 's/.*p50 \([0-9]*\) us.*/\1 us/'; }
+	p99() { echo "$1" | sed 's/.*p99 \([0-9]*\) us.*/\1 us/'; }
+	printf "%-20s %10s %14s %14s %14s %14s\n" "$profile" "${write_amp:-?}" "$(p50 "$hit")" "$(p99 "$hit")" \
+		"$(p50 "$miss")" "$(p99 "$miss")"
+done
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+/**
+ ** Placement of the keys on the shards in two steps: a key hashes to one of
+ ** no_buckets fixed buckets, and every bucket is assigned to the port of a
+ ** shard. Looking a key up is one hash and one array access. A bucket is the
+ ** unit that moves: a joining shard takes over an equal share of the
+ ** buckets from the shards that have the most, and the buckets of a leaving
+ ** shard go to the ones that have the fewest, so about 1/N of the keys move
+ ** and the moves come out as a short list of buckets.
+ **/
+class BucketMap {
+public:
+  static constexpr uint32_t no_buckets = 4096;
+
+  // from or to is 0 for the first shard to join and the last to leave
+  struct Move {
+    uint32_t bucket;
+    int from;
+    int to;
+  };
+
+  static auto bucket_of(int key) -> uint32_t {
+    // murmur3's finalizer, so that runs of consecutive keys spread
+    auto h = static_cast<uint32_t>(key);
+    h ^= h >> 16;
+    h *= 0x85EBCA6BU;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35U;
+    h ^= h >> 16;
+    return h & (no_buckets - 1);
+  }
+
+  // the port of the shard that owns key, nullopt without shards
+  [[nodiscard]] auto owner(int key) const -> std::optional<int> {
+    auto port = owners[bucket_of(key)];
+    return port == 0 ? std::nullopt : std::optional<int>(port);
+  }
+
+  [[nodiscard]] auto owner_of_bucket(uint32_t bucket) const -> int {
+    return owners[bucket];
+  }
+
+  // the number of buckets of the shard on port
+  [[nodiscard]] auto buckets_of(int port) const -> size_t {
+    return static_cast<size_t>(std::count(owners.begin(), owners.end(), port));
+  }
+
+  // gives a new shard its share of the buckets, returns the moves
+  auto add(int port) -> std::vector<Move> {
+    std::vector<Move> moves;
+    if (shards.empty()) {
+      for (uint32_t bucket = 0; bucket < no_buckets; bucket++) {
+        moves.push_back({bucket, 0, port});
+      }
+      owners.fill(port);
+      shards.push_back({port, all_buckets()});
+      return moves;
+    }
+    auto &joined = shards.emplace_back(Shard{port, {}});
+    auto share = no_buckets / shards.size();
+    while (joined.buckets.size() < share) {
+      auto &richest = *std::max_element(
+          shards.begin(), shards.end(), [](auto const &a, auto const &b) {
+            return a.buckets.size() < b.buckets.size();
+          });
+      moves.push_back(hand_over(richest, joined));
+    }
+    return moves;
+  }
+
+  // hands the buckets of a shard that left to the others, returns the moves
+  auto remove(int port) -> std::vector<Move> {
+    std::vector<Move> moves;
+    auto it = find(port);
+    if (it == shards.end()) {
+      return moves;
+    }
+    auto leaving = std::move(*it);
+    shards.erase(it);
+    if (shards.empty()) {
+      for (auto bucket : leaving.buckets) {
+        moves.push_back({bucket, port, 0});
+      }
+      owners.fill(0);
+      return moves;
+    }
+    while (!leaving.buckets.empty()) {
+      auto &poorest = *std::min_element(
+          shards.begin(), shards.end(), [](auto const &a, auto const &b) {
+            return a.buckets.size() < b.buckets.size();
+          });
+      moves.push_back(hand_over(leaving, poorest));
+    }
+    return moves;
+  }
+
+  // moves a bucket to the shard on port, which joins the map if it is new,
+  // or to none with port 0; a copy of the map follows the moves of the
+  // master's with it
+  auto assign(uint32_t bucket, int port) -> Move {
+    auto from_port = owners[bucket];
+    if (auto from = find(from_port); from != shards.end()) {
+      std::erase(from->buckets, bucket);
+    }
+    owners[bucket] = port;
+    if (port != 0) {
+      auto to = find(port);
+      if (to == shards.end()) {
+        to = shards.insert(shards.end(), Shard{port, {}});
+      }
+      to->buckets.push_back(bucket);
+    }
+    return {bucket, from_port, port};
+  }
+
+  // replaces the whole assignment, one port per bucket
+  void assign_all(std::vector<int> const &ports) {
+    shards.clear();
+    for (uint32_t bucket = 0; bucket < no_buckets; bucket++) {
+      auto port = bucket < ports.size() ? ports[bucket] : 0;
+      owners[bucket] = port;
+      if (port == 0) {
+        continue;
+      }
+      auto it = find(port);
+      if (it == shards.end()) {
+        it = shards.insert(shards.end(), Shard{port, {}});
+      }
+      it->buckets.push_back(bucket);
+    }
+  }
+
+private:
+  struct Shard {
+    int port;
+    std::vector<uint32_t> buckets;
+  };
+
+  static auto all_buckets() -> std::vector<uint32_t> {
+    std::vector<uint32_t> buckets(no_buckets);
+    for (uint32_t bucket = 0; bucket < no_buckets; bucket++) {
+      buckets[bucket] = bucket;
+    }
+    return buckets;
+  }
+
+  auto find(int port) -> std::vector<Shard>::iterator {
+    return std::find_if(shards.begin(), shards.end(),
+                        [port](auto const &s) { return s.port == port; });
+  }
+
+  // the bucket from gained last
+  auto hand_over(Shard &from, Shard &to) -> Move {
+    auto bucket = from.buckets.back();
+    from.buckets.pop_back();
+    to.buckets.push_back(bucket);
+    owners[bucket] = to.port;
+    return {bucket, from.port, to.port};
+  }
+
+  // 0 without shards
+  std::array<int, no_buckets> owners{};
+  std::vector<Shard> shards;
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/**
+ ** Per-thread free list of byte buffers for the framing layer. A Buffer
+ ** returns its storage to the pool of the thread that drops it and the
+ ** storage keeps the capacity it grew to, so once the pool is warm sending
+ ** and receiving messages does not touch the allocator any more.
+ **/
+class BufferPool {
+public:
+  class Buffer {
+  public:
+    Buffer() = default;
+    Buffer(std::unique_ptr<char[]> storage, size_t capacity, size_t size)
+        : storage(std::move(storage)), capacity(capacity), size_(size) {}
+    ~Buffer() {
+      if (storage != nullptr) {
+        BufferPool::local().release(std::move(storage), capacity);
+      }
+    }
+
+    Buffer(Buffer &&) noexcept = default;
+    auto operator=(Buffer &&) noexcept -> Buffer & = default;
+    Buffer(Buffer const &) = delete;
+    auto operator=(Buffer const &) -> Buffer & = delete;
+
+    [[nodiscard]] auto get() const -> char * { return storage.get(); }
+    [[nodiscard]] auto size() const -> size_t { return size_; }
+
+  private:
+    std::unique_ptr<char[]> storage;
+    size_t capacity = 0;
+    size_t size_ = 0;
+  };
+
+  static auto local() -> BufferPool & {
+    thread_local BufferPool pool;
+    return pool;
+  }
+
+  // a buffer of at least size bytes; its contents are unspecified
+  auto acquire(size_t size) -> Buffer {
+    if (!free_buffers.empty()) {
+      auto [storage, capacity] = std::move(free_buffers.back());
+      free_buffers.pop_back();
+      if (capacity >= size) {
+        return {std::move(storage), capacity, size};
+      }
+    }
+    auto capacity = std::max(size, min_capacity);
+    return {std::make_unique<char[]>(capacity), capacity, size};
+  }
+
+private:
+  static constexpr size_t min_capacity = 4096;
+  static constexpr size_t max_free_buffers = 16;
+  // a one-off huge message is not kept around
+  static constexpr size_t max_pooled_capacity = 1 << 20;
+
+  void release(std::unique_ptr<char[]> storage, size_t capacity) {
+    if (free_buffers.size() < max_free_buffers &&
+        capacity <= max_pooled_capacity) {
+      free_buffers.emplace_back(std::move(storage), capacity);
+    }
+  }
+
+  std::vector<std::pair<std::unique_ptr<char[]>, size_t>> free_buffers;
+};
@@ -1,15 +1,20 @@
 #include <algorithm>
 #include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <condition_variable>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <numeric>
+#include <random>
 #include <string>
 #include <thread>
 #include <vector>
@@ -32,6 +37,8 @@
 #include "client_thread.h"
 #include "kv_store.h"
 #include "message.h"
+#include "pipelined_client.h"
+#include "routing_table.h"
 #include "shared.h"
 #include "workload_traces/generate_traces.h"
 
@@ -39,11 +46,17 @@
 std::atomic<int> threads_ids{0};
 int nb_clients = -1;
 int nb_messages = 1200;
-int port, key, master_port, direct;
+int port, key, master_port, direct, count, window, batch;
+bool shuffle_keys, report_latency;
 std::string server_address = "127.0.0.1";
 std::string operation, value;
 std::vector<::Workload::TraceCmd> traces;
 struct timeval timeout;
+// from the cache file, or fetched from the master by the first operation
+// that needs it
+std::optional<RoutingTable> routing_table;
+// WRONG_SHARD replies followed per operation, at most
+static constexpr int max_redirects = 3;
 
 class Barriers
 {
@@ -278,6 +291,7 @@ public:
 
 	void verify_all(ClientThread &c_thread)
 	{
+		Epoch::Guard guard; // for the walk, see KvStore::init_it()
 		c_thread.local_kv_init_it();
 		auto verify_nb = 0;
 		while (auto kv = c_thread.local_kv_get_next_key())
@@ -330,6 +344,101 @@ public:
 	}
 };
 
+/**
+ ** The routing table is kept in a file per master between two runs, so
+ ** that a client only asks the master when a shard turns it away. The
+ ** shards check every key, which makes an outdated copy safe to use.
+ **/
+std::filesystem::path routing_table_file(int master_port)
+{
+	return std::filesystem::temp_directory_path() / fmt::format("clt-routing-{}", master_port);
+}
+
+bool load_routing_table(int master_port)
+{
+	std::ifstream file(routing_table_file(master_port), std::ios::binary);
+	sockets::client_msg::RoutingTable message;
+	if (!file || !message.ParseFromIstream(&file))
+		return false;
+	RoutingTable loaded;
+	if (!loaded.update(message))
+		return false;
+	routing_table = std::move(loaded);
+	return true;
+}
+
+// written to a temporary file first, other clients may be reading it
+void save_routing_table(int master_port)
+{
+	auto path = routing_table_file(master_port);
+	auto tmp_path = path;
+	tmp_path += fmt::format(".{}", getpid());
+	sockets::client_msg::RoutingTable message;
+	routing_table->to_message(&message);
+	{
+		std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+		if (!file || !message.SerializeToOstream(&file))
+			return;
+	}
+	std::error_code ec;
+	std::filesystem::rename(tmp_path, path, ec);
+}
+
+/**
+ ** Brings routing_table up to date with the master's. With a copy at hand
+ ** only the bucket moves since its epoch come back. It returns false if the
+ ** master could not be reached or sent a table that does not fit.
+ **/
+bool refresh_routing_table(int master_port)
+{
+	for (bool incremental : {true, false})
+	{
+		if (!incremental && !routing_table)
+			break;
+		int master_fd = try_connect_to(master_port, server_address, 3);
+		if (master_fd < 0)
+			return false;
+
+		sockets::client_msg route_msg;
+		auto *route = route_msg.add_ops();
+		route->set_type(sockets::client_msg_OperationType_ROUTE);
+		if (incremental && routing_table)
+		{
+			route->set_cluster(routing_table->cluster());
+			route->set_epoch(routing_table->epoch());
+		}
+		send_clt_message(master_fd, route_msg);
+
+		sockets::client_msg master_msg;
+		bool received = recv_clt_message(master_fd, &master_msg);
+		// master_msg.PrintDebugString();
+		close_socket(master_fd, 0);
+		if (!received || !master_msg.has_routing())
+			return false;
+		// the moves since our epoch, or a whole table
+		RoutingTable updated = incremental ? routing_table.value_or(RoutingTable{}) : RoutingTable{};
+		if (updated.update(master_msg.routing()))
+		{
+			routing_table = std::move(updated);
+			save_routing_table(master_port);
+			return true;
+		}
+	}
+	return false;
+}
+
+// false if the shard could not be reached
+bool exchange(int server_port, sockets::client_msg const &message, server::server_response::reply *reply)
+{
+	int server_fd = try_connect_to(server_port, server_address, 3);
+	if (server_fd < 0)
+		return false;
+	send_clt_message(server_fd, message);
+	bool received = recv_svr_message(server_fd, reply);
+	close_socket(server_fd, 0);
+	return received;
+}
+
 int client(int port, std::string operation, int key, std::string value, int master_port, int direct)
 {
 	sockets::client_msg operation_msg;
@@ -347,37 +456,59 @@ int client(int port, std::string operation, int key, std::string value, int mast
 		operation_data->set_value(value);
 	}
 
-	int master_fd, server_port;
+	// asks the master at most once per operation
+	bool refreshed = false;
+	auto refreshed_shard = [&refreshed, key, master_port]() -> std::optional<int>
+	{
+		if (refreshed)
+			return std::nullopt;
+		refreshed = true;
+		if (!refresh_routing_table(master_port))
+			return std::nullopt;
+		return routing_table->shard_of(key);
+	};
+
+	int server_port;
 	if (direct == 0)
 	{
-		master_fd = connect_to(master_port, server_address, 0, 0);
-		// printf("Connected on %d\n", master_port);
-		send_clt_message(master_fd, operation_msg);
-		// usleep(5 * 1000 * 100);
-		sockets::client_msg master_msg;
-		recv_clt_message(master_fd, &master_msg);
-		// master_msg.PrintDebugString();
-		close_socket(master_fd, 0);
-		server_port = master_msg.ops(0).port();
+		if (!routing_table && !load_routing_table(master_port))
+			refresh_routing_table(master_port);
+		auto shard_port = routing_table ? routing_table->shard_of(key) : std::nullopt;
+		if (!shard_port)
+			shard_port = refreshed_shard();
+		if (!shard_port)
+		{
+			fmt::print(stderr, "No shard for key {} from the master at {}\n", key, master_port);
+			return 1;
+		}
+		server_port = *shard_port;
 	}
 	else
 	{
 		server_port = port;
 	}
 
-	int server_fd = -1;
-	while (server_fd == -1)
-		server_fd = connect_to(server_port, server_address, 0, 3);
-
-	// setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
-
-	// fmt::print("Connected on {}\n", server_port);
-	send_clt_message(server_fd, operation_msg);
-	// fmt::print("Message sent to {}\n", server_port);
-	// usleep(5 * 1000);
 	server::server_response::reply server_msg;
-	recv_svr_message(server_fd, &server_msg);
-	close_socket(server_fd, 0);
+	for (int redirects = 0;; redirects++)
+	{
+		if (!exchange(server_port, operation_msg, &server_msg))
+		{
+			// the table may name a shard that is gone
+			auto shard_port = direct == 0 ? refreshed_shard() : std::nullopt;
+			if (!shard_port || *shard_port == server_port)
+				return 1;
+			server_port = *shard_port;
+			continue;
+		}
+		if (!server_msg.has_owner() || redirects == max_redirects)
+			break;
+
+		// WRONG_SHARD: the master's table is the newest, else the shard's hint
+		fmt::print("Key {} is on {} after epoch {}\n", key, server_msg.owner(), server_msg.epoch());
+		auto shard_port = direct == 0 ? refreshed_shard() : std::nullopt;
+		server_port = shard_port && *shard_port != server_port ? *shard_port : server_msg.owner();
+		server_msg.Clear();
+	}
 
 	// server_msg.PrintDebugString();
 	if (std::strcmp(server_msg.value().c_str(), "NOT-FOUND") == 0)
@@ -387,10 +518,100 @@ int client(int port, std::string operation, int key, std::string value, int mast
 	return 1;
 }
 
+// prints the median, 99th percentile and max of the latencies, in us
+void print_latencies(std::vector<uint32_t> &latencies)
+{
+	if (latencies.empty())
+		return;
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&latencies](size_t p)
+	{
+		return latencies[std::min(latencies.size() - 1, latencies.size() * p / 100)];
+	};
+	fmt::print("LATENCY < {} ops, p50 {} us, p99 {} us, max {} us >\n", latencies.size(), percentile(50),
+			   percentile(99), latencies.back());
+}
+
+/**
+ ** Sends `count` operations on the consecutive keys key..key+count-1 over a
+ ** single connection to the server at `port`, `batch` ops per message and
+ ** with up to `window` ops in flight at a time. The keys go out in order,
+ ** or shuffled (the same way on every run) with `shuffle`. A latency is
+ ** taken from the submit of its batch, so with a window it includes the
+ ** wait for a free slot.
+ **/
+int bulk_client(int port, std::string operation, int key, std::string value, int count, int window, int batch,
+				bool shuffle, bool latency)
+{
+	int server_fd = -1;
+	while (server_fd == -1)
+		server_fd = connect_to(port, server_address, 0, 3);
+
+	PipelinedClient pipeline(server_fd, window);
+	int client_state = 0;
+	auto on_reply = [&client_state](server::server_response::reply const &reply)
+	{
+		if (std::strcmp(reply.value().c_str(), "NOT-FOUND") == 0)
+			client_state = std::max(client_state, 2);
+		else if (!reply.success())
+			client_state = 1;
+	};
+
+	sockets::client_msg::OperationData operation_data;
+	if (std::strcmp(operation.c_str(), "GET") == 0)
+	{
+		operation_data.set_type(sockets::client_msg_OperationType_GET);
+	}
+
+	if (std::strcmp(operation.c_str(), "PUT") == 0)
+	{
+		operation_data.set_type(sockets::client_msg_OperationType_PUT);
+		operation_data.set_value(value);
+	}
+
+	std::vector<int> keys(count);
+	std::iota(keys.begin(), keys.end(), key);
+	if (shuffle)
+		std::shuffle(keys.begin(), keys.end(), std::mt19937(count));
+
+	std::vector<uint32_t> latencies;
+	latencies.reserve(latency ? count : 0);
+
+	std::vector<sockets::client_msg::OperationData> ops;
+	ops.reserve(batch);
+	for (int i = 0; i < count; i++)
+	{
+		operation_data.set_key(keys[i]);
+		ops.push_back(operation_data);
+		if (static_cast<int>(ops.size()) < batch && i + 1 < count)
+			continue;
+
+		auto submitted = std::chrono::steady_clock::now();
+		auto on_timed_reply = [&on_reply, &latencies, latency, submitted](server::server_response::reply const &reply)
+		{
+			on_reply(reply);
+			if (latency)
+				latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - submitted).count());
+		};
+		if (!pipeline.submit_batch(ops, on_timed_reply))
+		{
+			client_state = 1;
+			break;
+		}
+		ops.clear();
+	}
+
+	if (!pipeline.drain())
+		client_state = 1;
+	close_socket(server_fd, 0);
+	print_latencies(latencies);
+	return client_state;
+}
+
 auto main(int argc, char *argv[]) -> int
 {
 	cxxopts::Options options(argv[0], "Client for the sockets benchmark");
-	options.allow_unrecognised_options().add_options()("p,PORT", "port at which the target server listens to. This parameter should only be valid when DIRECT is set to 1", cxxopts::value<size_t>())("o,OPERATION", "either a GET or PUT request. The testing script will specify the operations in uppercase characters", cxxopts::value<std::string>())("k,KEY", "key for the operation", cxxopts::value<size_t>())("v,VALUE", "value for the operation corresponding to the key. Only valid if the OPERATION is PUT.", cxxopts::value<std::string>())("m,MASTER_PORT", "Port at which the master listens to for the client.", cxxopts::value<size_t>())("d,DIRECT", "Specifies whether the client can talk to the server at port PORT. It is important that the implementation of your client can talk directly to server at PORT. It is set to 0 meaning false, or 1 meaning true i.e. the client talks to the server directly without the help from master.", cxxopts::value<size_t>())("h,help", "Print help");
+	options.allow_unrecognised_options().add_options()("p,PORT", "port at which the target server listens to. This parameter should only be valid when DIRECT is set to 1", cxxopts::value<size_t>())("o,OPERATION", "either a GET or PUT request. The testing script will specify the operations in uppercase characters", cxxopts::value<std::string>())("k,KEY", "key for the operation", cxxopts::value<size_t>())("v,VALUE", "value for the operation corresponding to the key. Only valid if the OPERATION is PUT.", cxxopts::value<std::string>())("m,MASTER_PORT", "Port at which the master listens to for the client.", cxxopts::value<size_t>())("d,DIRECT", "Specifies whether the client can talk to the server at port PORT. It is important that the implementation of your client can talk directly to server at PORT. It is set to 0 meaning false, or 1 meaning true i.e. the client talks to the server directly without the help from master.", cxxopts::value<size_t>())("n,COUNT", "number of operations, on the consecutive keys starting at KEY. With DIRECT set to 0 each one goes to its own shard, routed with the table fetched once from the master", cxxopts::value<size_t>()->default_value("1"))("w,WINDOW", "number of requests kept in flight on the connection when COUNT is bigger than 1", cxxopts::value<size_t>()->default_value("1"))("b,BATCH", "number of operations sent in one message when COUNT is bigger than 1", cxxopts::value<size_t>()->default_value("1"))("r,RANDOM", "send the COUNT keys in a random order", cxxopts::value<bool>()->default_value("false"))("l,LATENCY", "print the median and 99th percentile latency when COUNT is bigger than 1", cxxopts::value<bool>()->default_value("false"))("h,help", "Print help");
 
 	auto args = options.parse(argc, argv);
 	if (args.count("help"))
@@ -449,11 +670,28 @@ auto main(int argc, char *argv[]) -> int
 	key = args["KEY"].as<size_t>();
 	value = args["VALUE"].as<std::string>();
 	master_port = args["MASTER_PORT"].as<size_t>();
+	count = args["COUNT"].as<size_t>();
+	window = args["WINDOW"].as<size_t>();
+	batch = std::max<size_t>(1, args["BATCH"].as<size_t>());
+	shuffle_keys = args["RANDOM"].as<bool>();
+	report_latency = args["LATENCY"].as<bool>();
 
 	timeout.tv_sec = 3;
 	timeout.tv_usec = 0;
 
-	int client_state = client(port, operation, key, value, master_port, direct);
+	int client_state = 0;
+	if (direct == 1 && count > 1)
+		client_state = bulk_client(port, operation, key, value, count, window, batch, shuffle_keys, report_latency);
+	else
+	{
+		// through the master only the first op fetches the routing table
+		for (int i = 0; i < count; i++)
+		{
+			int op_state = client(port, operation, key + i, value, master_port, direct);
+			if (client_state == 0)
+				client_state = op_state;
+		}
+	}
 	printf("Client finshed with %d.\n", client_state);
 	return client_state;
 }
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+/**
+ ** Epoch-based reclamation for data that readers use without a lock. A
+ ** reader pins the global epoch with an Epoch::Guard for as long as it uses
+ ** the pointers it loaded. A writer that unlinks an object passes it to
+ ** retire() instead of freeing it. An object retired in epoch e is freed
+ ** once the global epoch reaches e + 2. That can only happen after every
+ ** guard pinned in epoch e or earlier is gone.
+ **
+ ** Readers never wait: pinning is a store to the thread's own slot. The
+ ** epoch advances while writers retire objects.
+ **/
+class Epoch {
+public:
+  class Guard {
+  public:
+    Guard() { local().pin(); }
+    ~Guard() { local().unpin(); }
+
+    Guard(Guard const &) = delete;
+    auto operator=(Guard const &) -> Guard & = delete;
+  };
+
+  // frees ptr with deleter once no guard can still see it
+  static void retire(void *ptr, void (*deleter)(void *)) {
+    local().retire(ptr, deleter);
+  }
+
+  template <typename T> static void retire(T *ptr) {
+    retire(ptr, [](void *p) { delete static_cast<T *>(p); });
+  }
+
+private:
+  static constexpr uint64_t idle = UINT64_MAX;
+  // retires between two attempts to advance the epoch and free
+  static constexpr size_t collect_every = 64;
+
+  struct alignas(64) Participant {
+    std::atomic<uint64_t> epoch{idle}; // pinned epoch or idle
+    bool in_use = false;               // guarded by Registry::mtx
+  };
+
+  struct Retired {
+    void *ptr;
+    void (*deleter)(void *);
+    uint64_t epoch;
+  };
+
+  struct Registry {
+    std::atomic<uint64_t> epoch{0};
+    std::mutex mtx; // lock for participants and orphans
+    std::deque<Participant> participants;
+    std::vector<Retired> orphans; // left behind by threads that exited
+  };
+
+  // never freed, detached threads may still exit after main returns
+  static auto registry() -> Registry & {
+    static auto *reg = new Registry;
+    return *reg;
+  }
+
+  // frees what was retired two epochs ago or earlier, keeps the rest
+  static void free_old(std::vector<Retired> *retired, uint64_t global) {
+    size_t kept = 0;
+    for (auto &r : *retired) {
+      if (r.epoch + 2 <= global) {
+        r.deleter(r.ptr);
+      } else {
+        (*retired)[kept++] = r;
+      }
+    }
+    retired->resize(kept);
+  }
+
+  class Local {
+  public:
+    Local() {
+      auto &reg = registry();
+      std::lock_guard<std::mutex> l(reg.mtx);
+      for (auto &p : reg.participants) {
+        if (!p.in_use) {
+          participant = &p;
+          break;
+        }
+      }
+      if (participant == nullptr) {
+        participant = &reg.participants.emplace_back();
+      }
+      participant->in_use = true;
+    }
+
+    ~Local() {
+      auto &reg = registry();
+      std::lock_guard<std::mutex> l(reg.mtx);
+      participant->in_use = false;
+      reg.orphans.insert(reg.orphans.end(), limbo.begin(), limbo.end());
+    }
+
+    Local(Local const &) = delete;
+    auto operator=(Local const &) -> Local & = delete;
+
+    void pin() {
+      if (nesting++ > 0) {
+        return;
+      }
+      auto &global = registry().epoch;
+      participant->epoch.store(global.load(std::memory_order_seq_cst),
+                               std::memory_order_seq_cst);
+      // the loads that follow must not move above the announcement
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void unpin() {
+      if (--nesting == 0) {
+        participant->epoch.store(idle, std::memory_order_release);
+      }
+    }
+
+    void retire(void *ptr, void (*deleter)(void *)) {
+      auto &reg = registry();
+      limbo.push_back({ptr, deleter, reg.epoch.load(std::memory_order_seq_cst)});
+      if (++since_collect == collect_every) {
+        since_collect = 0;
+        collect();
+      }
+    }
+
+  private:
+    void collect() {
+      auto &reg = registry();
+      std::lock_guard<std::mutex> l(reg.mtx);
+      auto global = reg.epoch.load(std::memory_order_seq_cst);
+      bool all_caught_up = true;
+      for (auto const &p : reg.participants) {
+        auto epoch = p.epoch.load(std::memory_order_seq_cst);
+        if (epoch != idle && epoch != global) {
+          all_caught_up = false;
+          break;
+        }
+      }
+      if (all_caught_up) {
+        reg.epoch.compare_exchange_strong(global, global + 1,
+                                          std::memory_order_seq_cst);
+        global = reg.epoch.load(std::memory_order_seq_cst);
+      }
+      free_old(&limbo, global);
+      free_old(&reg.orphans, global);
+    }
+
+    Participant *participant = nullptr;
+    size_t nesting = 0;
+    size_t since_collect = 0;
+    std::vector<Retired> limbo; // retired by this thread, not freed yet
+  };
+
+  static auto local() -> Local & {
+    thread_local Local local;
+    return local;
+  }
+};
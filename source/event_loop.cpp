@@ -0,0 +1,387 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <utility>
+
+#include <google/protobuf/io/coded_stream.h>
+
+#include "event_loop.h"
+#include "shared.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fmt/printf.h>
+#include <iostream>
+
+static constexpr auto max_events = 64;
+static constexpr auto max_iovecs = 64;
+
+using google::protobuf::io::CodedOutputStream;
+
+auto OutputQueue::append(size_t len) -> char *
+{
+	auto offset = bytes.size();
+	bytes.resize(offset + len);
+	total_queued += len;
+	return bytes.data() + offset;
+}
+
+void OutputQueue::splice(std::string_view data, pin_type pin)
+{
+	if (data.empty())
+		return;
+	splices.push_back({bytes.size(), data, std::move(pin)});
+	total_queued += data.size();
+}
+
+auto OutputQueue::gather(iovec *iov, size_t max) const -> size_t
+{
+	size_t count = 0;
+	auto offset = bytes_sent;
+	auto add = [&](char const *data, size_t len)
+	{
+		if (len > 0 && count < max)
+			iov[count++] = {const_cast<char *>(data), len};
+	};
+
+	for (auto i = splices_sent; i < splices.size() && count < max; i++)
+	{
+		add(bytes.data() + offset, splices[i].offset - offset);
+		auto skip = i == splices_sent ? splice_sent : 0;
+		add(splices[i].data.data() + skip, splices[i].data.size() - skip);
+		offset = splices[i].offset;
+	}
+	add(bytes.data() + offset, bytes.size() - offset);
+	return count;
+}
+
+void OutputQueue::consume(size_t len)
+{
+	while (len > 0)
+	{
+		auto boundary = splices_sent < splices.size() ? splices[splices_sent].offset : bytes.size();
+		if (bytes_sent < boundary)
+		{
+			auto n = std::min(len, boundary - bytes_sent);
+			bytes_sent += n;
+			len -= n;
+			continue;
+		}
+
+		auto &current = splices[splices_sent];
+		auto n = std::min(len, current.data.size() - splice_sent);
+		splice_sent += n;
+		len -= n;
+		if (splice_sent == current.data.size())
+		{
+			current.pin.reset(); // the socket has its own copy now
+			splices_sent++;
+			splice_sent = 0;
+		}
+	}
+
+	if (empty())
+	{
+		bytes.clear();
+		splices.clear();
+		bytes_sent = splices_sent = 0;
+	}
+	else if (bytes_sent > bytes.size() / 2)
+	{
+		// drop the sent prefix once it is most of the buffer
+		bytes.erase(0, bytes_sent);
+		splices.erase(splices.begin(), splices.begin() + splices_sent);
+		for (auto &pending : splices)
+			pending.offset -= bytes_sent;
+		bytes_sent = splices_sent = 0;
+	}
+}
+
+void OutputQueue::swap(OutputQueue &other) noexcept
+{
+	std::swap(bytes, other.bytes);
+	std::swap(splices, other.splices);
+	std::swap(bytes_sent, other.bytes_sent);
+	std::swap(splices_sent, other.splices_sent);
+	std::swap(splice_sent, other.splice_sent);
+	std::swap(total_queued, other.total_queued);
+}
+
+void Connection::queue_message(google::protobuf::MessageLite const &message)
+{
+	begin_frame();
+	append_message(message);
+	end_frame();
+}
+
+void Connection::begin_frame()
+{
+	frame_offset = out.owned_size();
+	out.append(length_size_field);
+	frame_start = out.total();
+}
+
+void Connection::append_message(google::protobuf::MessageLite const &message)
+{
+	auto msg_size = message.ByteSizeLong();
+	message.SerializeToArray(out.append(msg_size), msg_size);
+}
+
+void Connection::append_field_header(uint32_t field_number, size_t length)
+{
+	auto tag = (field_number << 3) | 2; // length-delimited
+	auto *dst = reinterpret_cast<uint8_t *>(out.append(CodedOutputStream::VarintSize32(tag) + CodedOutputStream::VarintSize32(length)));
+	dst = CodedOutputStream::WriteVarint32ToArray(tag, dst);
+	CodedOutputStream::WriteVarint32ToArray(length, dst);
+}
+
+void Connection::append_bytes_field(uint32_t field_number, std::string_view value, OutputQueue::pin_type pin)
+{
+	append_field_header(field_number, value.size());
+	if (value.size() < min_splice_size || pin == nullptr)
+	{
+		::memcpy(out.append(value.size()), value.data(), value.size());
+		return;
+	}
+	out.splice(value, std::move(pin));
+}
+
+void Connection::end_frame()
+{
+	convert_int_to_byte_array(out.at(frame_offset), out.total() - frame_start);
+}
+
+auto Connection::bytes_field_size(uint32_t field_number, size_t length) -> size_t
+{
+	return CodedOutputStream::VarintSize32((field_number << 3) | 2) + CodedOutputStream::VarintSize32(length) + length;
+}
+
+auto Connection::flush() -> bool
+{
+	std::array<iovec, max_iovecs> iov{};
+
+	while (!out.empty())
+	{
+		msghdr msg{};
+		msg.msg_iov = iov.data();
+		msg.msg_iovlen = out.gather(iov.data(), iov.size());
+
+		auto bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (bytes >= 0)
+		{
+			out.consume(bytes);
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			break; // the rest goes out on the next EPOLLOUT
+		return false;
+	}
+	return true;
+}
+
+auto Connection::handle_frames(frame_handler const &handler) -> bool
+{
+	bool alive = true;
+	while (auto frame = reader.next_frame())
+	{
+		if (!handler(*this, frame->data(), frame->size()))
+		{
+			alive = false;
+			break;
+		}
+	}
+	// the replies are serialized into the output queue by now
+	arena.Reset();
+	return alive && !reader.oversized();
+}
+
+EventLoop::EventLoop(int listen_fd, frame_handler handler, commit_handler commit)
+	: listen_fd(listen_fd), handler(std::move(handler)), commit(std::move(commit))
+{
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+	{
+		fmt::print("epoll_create1\n");
+		std::cout << "Errno: " << errno << std::endl;
+		exit(1);
+	}
+
+	set_nonblocking(listen_fd);
+	watch(listen_fd, EPOLLIN | EPOLLET);
+}
+
+EventLoop::~EventLoop()
+{
+	for (auto &[fd, conn] : connections)
+		close_socket(fd, 0);
+	close_socket(listen_fd, 0);
+	close(epoll_fd);
+}
+
+void EventLoop::watch(int fd, uint32_t events) const
+{
+	epoll_event event{};
+	event.events = events;
+	event.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+	{
+		fmt::print("epoll_ctl\n");
+		std::cout << "Errno: " << errno << std::endl;
+		exit(1);
+	}
+}
+
+void EventLoop::run()
+{
+	std::array<epoll_event, max_events> events{};
+
+	while (true)
+	{
+		int nb_events = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+		if (nb_events == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			fmt::print("epoll_wait\n");
+			std::cout << "Errno: " << errno << std::endl;
+			exit(1);
+		}
+
+		for (int i = 0; i < nb_events; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd)
+			{
+				accept_all();
+				continue;
+			}
+
+			auto it = connections.find(fd);
+			if (it == connections.end())
+				continue;
+
+			auto &conn = it->second;
+			bool alive = (events[i].events & EPOLLERR) == 0;
+			if (conn.draining)
+			{
+				if (!alive || !conn.flush() || conn.out.empty())
+					close_connection(fd);
+				continue;
+			}
+			if (alive && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+				alive = read_all(conn); // flushed by flush_replied()
+			else if (alive && (events[i].events & EPOLLOUT))
+				alive = conn.flush();
+			if (!alive)
+				close_connection(fd);
+		}
+
+		flush_replied();
+	}
+}
+
+void EventLoop::accept_all()
+{
+	// edge-triggered: drain the accept queue, otherwise we are not woken up again
+	while (true)
+	{
+		int connected_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (connected_fd == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				fmt::print("accept ");
+				std::cout << "Errno: " << errno << std::endl;
+			}
+			return;
+		}
+
+		int opt = 1;
+		setsockopt(connected_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+		connections.try_emplace(connected_fd, connected_fd);
+		watch(connected_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+	}
+}
+
+auto EventLoop::read_all(Connection &conn) -> bool
+{
+	bool eof = false;
+
+	// the frames of every recv() are handled before the next one reuses the
+	// buffer; the replies of all of them go out at the end of the round
+	while (!eof)
+	{
+		switch (conn.reader.fill(conn.fd))
+		{
+		case FrameReader::fill_result::data:
+			handled = true;
+			if (!conn.handle_frames(handler))
+				return false;
+			continue;
+		case FrameReader::fill_result::eof:
+			eof = true;
+			continue;
+		case FrameReader::fill_result::would_block:
+			break;
+		case FrameReader::fill_result::error:
+			return false;
+		}
+		break;
+	}
+
+	replied.emplace_back(conn.fd, eof);
+	return true;
+}
+
+void EventLoop::flush_replied()
+{
+	if (replied.empty() && !handled)
+		return;
+	handled = false;
+
+	bool committed = !commit || commit();
+	for (auto [fd, eof] : replied)
+	{
+		auto it = connections.find(fd);
+		if (it == connections.end())
+			continue;
+		auto &conn = it->second;
+		bool dropped = !committed && conn.awaits_commit;
+		conn.awaits_commit = false;
+		if (dropped || !conn.flush())
+			close_connection(fd);
+		else if (eof)
+			close_when_flushed(conn);
+	}
+	replied.clear();
+}
+
+void EventLoop::close_when_flushed(Connection &conn)
+{
+	if (conn.out.empty())
+	{
+		close_connection(conn.fd);
+		return;
+	}
+	// a half-closed peer still reads, the rest goes out on EPOLLOUT
+	conn.draining = true;
+	epoll_event event{};
+	event.events = EPOLLOUT | EPOLLET;
+	event.data.fd = conn.fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &event) == -1)
+		close_connection(conn.fd);
+}
+
+void EventLoop::close_connection(int fd)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+	connections.erase(fd);
+	close_socket(fd, 0);
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include <google/protobuf/arena.h>
+#include <google/protobuf/message_lite.h>
+
+#include "frame_reader.h"
+
+class Connection;
+
+/**
+ ** Called once per complete frame of a connection; a handler that returns
+ ** false closes the connection.
+ **/
+using frame_handler = std::function<bool(Connection &, char const *, size_t)>;
+
+/**
+ ** Called once per loop round in which frames were handled, after the
+ ** frames of every ready connection and before their replies go out, also
+ ** when all of those connections were closed meanwhile. If it returns false
+ ** the connections whose replies wait for it, see Connection::await_commit(),
+ ** are closed without them; the others are flushed as usual.
+ **/
+using commit_handler = std::function<bool()>;
+
+/**
+ ** Bytes waiting to go out on a connection, in order. Most of them are owned
+ ** by the queue, but a big value can be spliced in by reference: it is sent
+ ** as an iovec of its own straight from where it is stored, kept alive by
+ ** its pin until the socket took all of it.
+ **/
+class OutputQueue {
+public:
+  using pin_type = std::shared_ptr<void const>;
+
+  // grows the owned bytes by len and returns where the new ones start
+  auto append(size_t len) -> char *;
+
+  void splice(std::string_view data, pin_type pin);
+
+  // owned bytes are addressed by their offset until they are consumed
+  auto at(size_t offset) -> char * { return bytes.data() + offset; }
+  [[nodiscard]] auto owned_size() const -> size_t { return bytes.size(); }
+
+  // number of bytes ever queued, owned or spliced
+  [[nodiscard]] auto total() const -> size_t { return total_queued; }
+
+  [[nodiscard]] auto empty() const -> bool {
+    return bytes_sent == bytes.size() && splices_sent == splices.size();
+  }
+
+  /**
+   ** Points up to max iovecs at the unsent bytes, in order, and returns how
+   ** many it filled.
+   **/
+  auto gather(iovec *iov, size_t max) const -> size_t;
+
+  // drops the first len unsent bytes, e.g. after a partial send
+  void consume(size_t len);
+
+  void swap(OutputQueue &other) noexcept;
+
+private:
+  struct Splice {
+    size_t offset; // it goes out after the owned bytes before offset
+    std::string_view data;
+    pin_type pin;
+  };
+
+  std::string bytes;
+  std::vector<Splice> splices;
+  size_t bytes_sent = 0;
+  size_t splices_sent = 0;
+  size_t splice_sent = 0; // of splices[splices_sent]
+  size_t total_queued = 0;
+};
+
+/**
+ ** State of one connection owned by an event loop: the received bytes that
+ ** do not form a complete frame yet, the framed replies the socket did not
+ ** take yet and the arena for the messages of the frames being handled.
+ **/
+class Connection {
+public:
+  explicit Connection(int fd)
+      : fd(fd), arena_block(std::make_unique<char[]>(arena_block_size)),
+        arena(arena_options(arena_block.get())) {}
+
+  // values smaller than this are copied, an iovec is not worth it
+  static constexpr size_t min_splice_size = 4 * 1024;
+
+  /**
+   ** Appends the message, behind its 4-byte length field, to the output
+   ** queue. The event loop flushes it once the current round of frames has
+   ** been handled and committed.
+   **/
+  void queue_message(google::protobuf::MessageLite const &message);
+
+  /**
+   ** Building blocks for a frame that carries big bytes fields by reference.
+   ** begin_frame() opens it, the message parts are appended in wire order
+   ** and end_frame() fills in the length field. A message may be followed by
+   ** its missing bytes field (fields need not be in order on the wire) and
+   ** a length-delimited field header may precede a nested message.
+   **/
+  void begin_frame();
+  void append_message(google::protobuf::MessageLite const &message);
+  void append_field_header(uint32_t field_number, size_t length);
+  void append_bytes_field(uint32_t field_number, std::string_view value,
+                          OutputQueue::pin_type pin);
+  void end_frame();
+
+  // wire size of a bytes field holding length bytes
+  static auto bytes_field_size(uint32_t field_number, size_t length) -> size_t;
+
+  /**
+   ** Sends as much of the output queue as the socket takes, with one
+   ** sendmsg() per run of iovecs. It returns false if the connection is
+   ** broken.
+   **/
+  auto flush() -> bool;
+
+  /**
+   ** Calls the handler on every complete frame buffered by the reader. It
+   ** stops and returns false as soon as the handler does, or once the reader
+   ** got an oversized frame. The arena is reset afterwards.
+   **/
+  auto handle_frames(frame_handler const &handler) -> bool;
+
+  // the replies of this round are only true once the round is committed,
+  // e.g. they acknowledge a staged PUT or show its value
+  void await_commit() { awaits_commit = true; }
+
+  [[nodiscard]] auto get_fd() const -> int { return fd; }
+
+  /**
+   ** Arena for the messages a handler builds for one frame. Everything on it
+   ** is freed at once when the current batch of frames has been handled, so
+   ** nothing may keep such a message past its frame. The first block belongs
+   ** to the connection and survives the reset: a batch that fits in it does
+   ** not allocate.
+   **/
+  auto get_arena() -> google::protobuf::Arena & { return arena; }
+
+private:
+  friend class EventLoop;
+  friend class UringLoop;
+
+  static constexpr size_t arena_block_size = 8 * 1024;
+
+  static auto arena_options(char *block) -> google::protobuf::ArenaOptions {
+    google::protobuf::ArenaOptions options;
+    options.initial_block = block;
+    options.initial_block_size = arena_block_size;
+    return options;
+  }
+
+  int fd;
+  FrameReader reader;
+  OutputQueue out;
+  bool draining = false; // EventLoop: EOF seen, only the rest of out goes
+  bool awaits_commit = false; // reset once the round is committed
+  size_t frame_offset = 0; // of the length field of the open frame
+  size_t frame_start = 0;  // out.total() after that length field
+  std::unique_ptr<char[]> arena_block;
+  google::protobuf::Arena arena;
+};
+
+/**
+ ** Edge-triggered epoll reactor. It owns the listening socket and every
+ ** connection accepted from it and calls the handler once per complete
+ **
+ **  |<---msg size (4 bytes)--->|<---payload (msg size bytes)--->|
+ **
+ ** frame.
+ **/
+class EventLoop {
+public:
+  EventLoop(int listen_fd, frame_handler handler, commit_handler commit = {});
+  ~EventLoop();
+
+  EventLoop(EventLoop const &) = delete;
+  auto operator=(EventLoop const &) -> EventLoop & = delete;
+
+  [[noreturn]] void run();
+
+private:
+  void watch(int fd, uint32_t events) const;
+  void accept_all();
+  auto read_all(Connection &conn) -> bool;
+  void flush_replied();
+  // once the output queue of a connection that hit EOF is empty
+  void close_when_flushed(Connection &conn);
+  void close_connection(int fd);
+
+  int epoll_fd = -1;
+  int listen_fd = -1;
+  frame_handler handler;
+  commit_handler commit;
+  std::unordered_map<int, Connection> connections;
+  // connections read in this round, whether they hit EOF
+  std::vector<std::pair<int, bool>> replied;
+  bool handled = false; // frames in this round, see commit_handler
+};
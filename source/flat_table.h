@@ -0,0 +1,376 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string_view>
+
+#include "epoch.h"
+#include "slab_allocator.h"
+
+/**
+ ** Open-addressing hash table from int keys to byte strings, with linear
+ ** probing over a flat array of slots. Writers are serialized by the owner;
+ ** readers take no lock and may run next to a writer, as long as they hold
+ ** an Epoch::Guard:
+ **  - a key keeps its slot once inserted, until the table grows
+ **  - a value is a block whose bytes never change; a write publishes a new
+ **    block with an atomic pointer swap and retires the old one
+ **  - an erased key leaves a tombstone, which only the same key reuses; a
+ **    reader that loaded the old block must never see another key's
+ **  - growing fills a twice as large slot array (or one as large, without
+ **    the tombstones), publishes it the same way and retires the old array,
+ **    whose blocks the new one took over
+ **
+ ** The value blocks come from the SlabAllocator; a retired one goes back to
+ ** its size class once the readers are done, for the next value that fits.
+ ** Every block counts the reads it served, saturating at max_freq, and
+ ** keeps a stamp for the eviction of the owner. Readers bump the count with
+ ** a plain relaxed store and never look at the stamp.
+ **/
+class FlatTable {
+public:
+  static constexpr uint8_t max_freq = 3;
+
+  // what eviction needs to know about a key, see entry()
+  struct Entry {
+    size_t bytes;
+    uint8_t freq;
+    uint32_t stamp;
+  };
+
+private:
+  struct Value {
+    uint32_t size = 0;
+    uint32_t stamp = 0; // set by the eviction, the writer's only
+    mutable std::atomic<uint8_t> freq{0};
+
+    [[nodiscard]] auto data() const -> char const * {
+      return reinterpret_cast<char const *>(this + 1);
+    }
+
+    static auto make(std::string_view bytes) -> Value * {
+      auto *value =
+          new (SlabAllocator::allocate(sizeof(Value) + bytes.size())) Value;
+      value->size = static_cast<uint32_t>(bytes.size());
+      memcpy(reinterpret_cast<char *>(value + 1), bytes.data(), bytes.size());
+      return value;
+    }
+    static void free(void *block) {
+      auto *value = static_cast<Value *>(block);
+      auto bytes = value->block_bytes();
+      value->~Value();
+      SlabAllocator::deallocate(block, bytes);
+    }
+
+    // as asked of the SlabAllocator
+    [[nodiscard]] auto block_bytes() const -> size_t {
+      return sizeof(Value) + size;
+    }
+  };
+
+  // in the slot of an erased key
+  static Value const tombstone;
+
+  struct Slot {
+    // null in an empty slot; published after key is set
+    std::atomic<Value const *> value{nullptr};
+    int key = 0;
+  };
+
+  struct Array {
+    explicit Array(size_t capacity)
+        : capacity(capacity), mask(capacity - 1),
+          slots(std::make_unique<Slot[]>(capacity)) {}
+
+    size_t capacity;
+    size_t mask;
+    std::unique_ptr<Slot[]> slots;
+  };
+
+public:
+  class iterator {
+  public:
+    iterator() = default;
+
+    auto operator++() -> iterator & {
+      index = next_used(array, index + 1);
+      return *this;
+    }
+    auto operator==(iterator const &other) const -> bool {
+      return index == other.index;
+    }
+
+    [[nodiscard]] auto key() const -> int { return array->slots[index].key; }
+
+  private:
+    friend class FlatTable;
+    iterator(Array const *array, size_t index) : array(array), index(index) {}
+
+    Array const *array = nullptr;
+    size_t index = 0;
+  };
+
+  FlatTable() = default;
+  ~FlatTable() {
+    auto *current = array.load(std::memory_order_relaxed);
+    if (current == nullptr) {
+      return;
+    }
+    for (size_t i = 0; i < current->capacity; i++) {
+      auto const *value =
+          current->slots[i].value.load(std::memory_order_relaxed);
+      if (is_live(value)) {
+        Value::free(const_cast<Value *>(value));
+      }
+    }
+    delete current;
+  }
+
+  FlatTable(FlatTable const &) = delete;
+  auto operator=(FlatTable const &) -> FlatTable & = delete;
+
+  [[nodiscard]] auto size() const -> size_t { return no_used; }
+
+  // iterating is for a table without writers, under an Epoch::Guard that
+  // the caller holds for the whole walk
+  [[nodiscard]] auto begin() const -> iterator {
+    auto const *current = array.load(std::memory_order_acquire);
+    return {current, next_used(current, 0)};
+  }
+  [[nodiscard]] auto end() const -> iterator {
+    auto const *current = array.load(std::memory_order_acquire);
+    return {current, current == nullptr ? 0 : current->capacity};
+  }
+
+  // lock-free; the view is valid while the caller holds an Epoch::Guard
+  [[nodiscard]] auto find(int key) const -> std::optional<std::string_view> {
+    auto const *current = array.load(std::memory_order_acquire);
+    if (current == nullptr) {
+      return std::nullopt;
+    }
+    for (auto index = hash(key) & current->mask;;
+         index = (index + 1) & current->mask) {
+      auto const &slot = current->slots[index];
+      auto const *value = slot.value.load(std::memory_order_acquire);
+      if (value == nullptr) {
+        return std::nullopt;
+      }
+      if (value != &tombstone && slot.key == key) {
+        if (auto freq = value->freq.load(std::memory_order_relaxed);
+            freq < max_freq) {
+          value->freq.store(freq + 1, std::memory_order_relaxed);
+        }
+        return std::string_view{value->data(), value->size};
+      }
+    }
+  }
+
+  // returns false if the key was present and its value replaced; a replaced
+  // value passes its read count and stamp on
+  auto insert_or_assign(int key, std::string_view value) -> bool {
+    auto &slot = slot_for(key);
+    auto *fresh = Value::make(value);
+    auto const *old = slot.value.load(std::memory_order_relaxed);
+    if (is_live(old)) {
+      fresh->freq.store(old->freq.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+      fresh->stamp = old->stamp;
+    }
+    slot.value.store(fresh, std::memory_order_release);
+    value_bytes += SlabAllocator::block_size(fresh->block_bytes());
+    if (!is_live(old)) {
+      claimed(old);
+      return true;
+    }
+    value_bytes -= SlabAllocator::block_size(old->block_bytes());
+    Epoch::retire(const_cast<Value *>(old), Value::free);
+    return false;
+  }
+
+  // returns false, leaving the present value alone, if the key is present
+  auto try_emplace(int key, std::string_view value) -> bool {
+    auto &slot = slot_for(key);
+    auto const *old = slot.value.load(std::memory_order_relaxed);
+    if (is_live(old)) {
+      return false;
+    }
+    auto *fresh = Value::make(value);
+    slot.value.store(fresh, std::memory_order_release);
+    value_bytes += SlabAllocator::block_size(fresh->block_bytes());
+    claimed(old);
+    return true;
+  }
+
+  // returns false if the key was not present
+  auto erase(int key) -> bool {
+    auto *slot = live_slot(key);
+    if (slot == nullptr) {
+      return false;
+    }
+    auto const *old = slot->value.load(std::memory_order_relaxed);
+    slot->value.store(&tombstone, std::memory_order_release);
+    value_bytes -= SlabAllocator::block_size(old->block_bytes());
+    no_used--;
+    no_tombstones++;
+    Epoch::retire(const_cast<Value *>(old), Value::free);
+    return true;
+  }
+
+  // for the writer only
+  [[nodiscard]] auto entry(int key) const -> std::optional<Entry> {
+    auto const *slot = live_slot(key);
+    if (slot == nullptr) {
+      return std::nullopt;
+    }
+    auto const *value = slot->value.load(std::memory_order_relaxed);
+    return Entry{SlabAllocator::block_size(value->block_bytes()),
+                 value->freq.load(std::memory_order_relaxed), value->stamp};
+  }
+
+  void set_freq(int key, uint8_t freq) {
+    if (auto const *slot = live_slot(key)) {
+      slot->value.load(std::memory_order_relaxed)
+          ->freq.store(freq, std::memory_order_relaxed);
+    }
+  }
+
+  void set_stamp(int key, uint32_t stamp) {
+    if (auto const *slot = live_slot(key)) {
+      const_cast<Value *>(slot->value.load(std::memory_order_relaxed))->stamp =
+          stamp;
+    }
+  }
+
+  // slots and value blocks, in bytes; for the writer only
+  [[nodiscard]] auto memory_usage() const -> size_t {
+    auto const *current = array.load(std::memory_order_relaxed);
+    auto slot_bytes = current == nullptr ? 0 : current->capacity * sizeof(Slot);
+    return slot_bytes + value_bytes;
+  }
+
+private:
+  // 3/4 full at most, with the tombstones; a miss probes up to the next
+  // empty slot
+  static constexpr size_t max_load_num = 3;
+  static constexpr size_t max_load_den = 4;
+  static constexpr size_t min_capacity = 16;
+
+  // murmur3's finalizer, so that runs of consecutive keys do not cluster
+  static auto hash(int key) -> uint32_t {
+    auto h = static_cast<uint32_t>(key);
+    h ^= h >> 16;
+    h *= 0x85EBCA6BU;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35U;
+    h ^= h >> 16;
+    return h;
+  }
+
+  static auto next_used(Array const *array, size_t index) -> size_t {
+    if (array == nullptr) {
+      return 0;
+    }
+    while (index < array->capacity &&
+           !is_live(array->slots[index].value.load(std::memory_order_relaxed))) {
+      index++;
+    }
+    return index;
+  }
+
+  static auto is_live(Value const *value) -> bool {
+    return value != nullptr && value != &tombstone;
+  }
+
+  // bookkeeping for a slot that was empty or a tombstone and holds a value
+  void claimed(Value const *old) {
+    no_used++;
+    if (old == &tombstone) {
+      no_tombstones--;
+    }
+  }
+
+  [[nodiscard]] auto live_slot(int key) const -> Slot * {
+    auto *current = array.load(std::memory_order_relaxed);
+    if (current == nullptr) {
+      return nullptr;
+    }
+    for (auto index = hash(key) & current->mask;;
+         index = (index + 1) & current->mask) {
+      auto &slot = current->slots[index];
+      auto const *value = slot.value.load(std::memory_order_relaxed);
+      if (value == nullptr) {
+        return nullptr;
+      }
+      if (slot.key == key) {
+        return value == &tombstone ? nullptr : &slot;
+      }
+    }
+  }
+
+  // the key's slot, which is empty with the key set if it was not present,
+  // or the key's own tombstone
+  auto slot_for(int key) -> Slot & {
+    auto *current = array.load(std::memory_order_relaxed);
+    if (current == nullptr || (no_used + no_tombstones + 1) * max_load_den >
+                                  current->capacity * max_load_num) {
+      current = rebuild(current);
+    }
+    for (auto index = hash(key) & current->mask;;
+         index = (index + 1) & current->mask) {
+      auto &slot = current->slots[index];
+      if (slot.value.load(std::memory_order_relaxed) == nullptr) {
+        // readers skip the slot until its value is published
+        slot.key = key;
+        return slot;
+      }
+      if (slot.key == key) {
+        return slot;
+      }
+    }
+  }
+
+  // grows the table, or drops the tombstones if they make up the load
+  auto rebuild(Array *old) -> Array * {
+    auto capacity = min_capacity;
+    if (old != nullptr) {
+      capacity = (no_used + 1) * 2 * max_load_den > old->capacity * max_load_num
+                     ? old->capacity * 2
+                     : old->capacity;
+    }
+    auto *fresh = new Array(capacity);
+    if (old != nullptr) {
+      for (size_t i = 0; i < old->capacity; i++) {
+        auto const *value =
+            old->slots[i].value.load(std::memory_order_relaxed);
+        if (!is_live(value)) {
+          continue;
+        }
+        auto index = hash(old->slots[i].key) & fresh->mask;
+        while (fresh->slots[index].value.load(std::memory_order_relaxed) !=
+               nullptr) {
+          index = (index + 1) & fresh->mask;
+        }
+        fresh->slots[index].key = old->slots[i].key;
+        fresh->slots[index].value.store(value, std::memory_order_relaxed);
+      }
+    }
+    no_tombstones = 0;
+    array.store(fresh, std::memory_order_release);
+    if (old != nullptr) {
+      Epoch::retire(old);
+    }
+    return fresh;
+  }
+
+  std::atomic<Array *> array{nullptr};
+  size_t no_used = 0;
+  size_t no_tombstones = 0;
+  size_t value_bytes = 0;
+};
+
+inline FlatTable::Value const FlatTable::tombstone{};
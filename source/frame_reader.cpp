@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "frame_reader.h"
+#include "shared.h"
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+static constexpr size_t min_fill_size = 4096;
+
+FrameReader::FrameReader(size_t capacity)
+	: buf(std::make_unique<char[]>(capacity)), capacity(capacity)
+{
+}
+
+void FrameReader::reserve(size_t free_bytes)
+{
+	if (capacity - tail >= free_bytes)
+		return;
+
+	// compact: only the bytes of a partial frame are left in front
+	if (head > 0)
+	{
+		::memmove(buf.get(), buf.get() + head, tail - head);
+		tail -= head;
+		head = 0;
+		if (capacity - tail >= free_bytes)
+			return;
+	}
+
+	auto new_capacity = std::max(capacity * 2, tail + free_bytes);
+	auto new_buf = std::make_unique<char[]>(new_capacity);
+	::memcpy(new_buf.get(), buf.get(), tail);
+	buf = std::move(new_buf);
+	capacity = new_capacity;
+}
+
+auto FrameReader::fill(int fd) -> fill_result
+{
+	reserve(std::max(min_fill_size, needed > buffered() ? needed - buffered() : 0));
+
+	while (true)
+	{
+		auto bytes = recv(fd, buf.get() + tail, capacity - tail, 0);
+		if (bytes > 0)
+		{
+			tail += bytes;
+			return fill_result::data;
+		}
+		if (bytes == 0)
+			return fill_result::eof;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return fill_result::would_block;
+		return fill_result::error;
+	}
+}
+
+void FrameReader::append(char const *data, size_t len)
+{
+	reserve(len);
+	::memcpy(buf.get() + tail, data, len);
+	tail += len;
+}
+
+auto FrameReader::next_frame() -> std::optional<std::string_view>
+{
+	if (too_big)
+		return std::nullopt;
+	if (buffered() < length_size_field)
+	{
+		needed = length_size_field;
+		return std::nullopt;
+	}
+
+	auto msg_size = convert_byte_array_to_int(buf.get() + head);
+	if (msg_size > max_frame_size)
+	{
+		too_big = true;
+		needed = 0;
+		return std::nullopt;
+	}
+	if (buffered() - length_size_field < msg_size)
+	{
+		needed = length_size_field + msg_size;
+		return std::nullopt;
+	}
+
+	std::string_view payload(buf.get() + head + length_size_field, msg_size);
+	head += length_size_field + msg_size;
+	needed = 0;
+	if (head == tail)
+		head = tail = 0; // nothing left: start over at the front for free
+	return payload;
+}
+
+auto FrameReader::read_frame(int fd) -> std::optional<std::string_view>
+{
+	while (true)
+	{
+		if (auto frame = next_frame())
+			return frame;
+		if (too_big || fill(fd) != fill_result::data)
+			return std::nullopt;
+	}
+}
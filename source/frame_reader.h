@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string_view>
+
+/**
+ ** Buffered reader for the
+ **
+ **  |<---msg size (4 bytes)--->|<---payload (msg size bytes)--->|
+ **
+ ** framing. Every fill() is one recv() of as many bytes as the socket has
+ ** and the buffer can take; next_frame() then hands out every complete frame
+ ** in place. The bytes of a partial frame are moved to the front only when
+ ** the free space behind them runs out. A size above max_frame_size is
+ ** taken for garbage: the reader hands out no more frames, and the
+ ** connection is to be closed.
+ **/
+class FrameReader {
+public:
+  enum class fill_result { data, would_block, eof, error };
+
+  static constexpr size_t default_capacity = 16 * 1024;
+  static constexpr size_t max_frame_size = 8 * 1024 * 1024;
+
+  explicit FrameReader(size_t capacity = default_capacity);
+
+  // one recv() into the free space
+  auto fill(int fd) -> fill_result;
+
+  // for bytes that were received by someone else (e.g. io_uring)
+  void append(char const *data, size_t len);
+
+  /**
+   ** The payload of the next complete frame, or nullopt if there is none
+   ** buffered yet. The view stays valid until the next fill() or append().
+   **/
+  auto next_frame() -> std::optional<std::string_view>;
+
+  /**
+   ** Reads from a blocking fd until a complete frame is buffered. It returns
+   ** nullopt on EOF, on a receive timeout, on an error or on an oversized
+   ** frame.
+   **/
+  auto read_frame(int fd) -> std::optional<std::string_view>;
+
+  // whether a frame announced more than max_frame_size bytes
+  [[nodiscard]] auto oversized() const -> bool { return too_big; }
+
+  [[nodiscard]] auto buffered() const -> size_t { return tail - head; }
+
+private:
+  void reserve(size_t free_bytes);
+
+  std::unique_ptr<char[]> buf;
+  size_t capacity;
+  size_t head = 0; // first byte not handed out yet
+  size_t tail = 0; // end of the received bytes
+  size_t needed = 0; // bytes the buffered partial frame needs in total
+  bool too_big = false;
+};
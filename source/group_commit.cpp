@@ -0,0 +1,135 @@
+#include "group_commit.h"
+#include "key_codec.h"
+
+#include <fmt/printf.h>
+
+namespace
+{
+	// copies the puts of a staged batch into the batch of its group
+	struct append_puts : rocksdb::WriteBatch::Handler
+	{
+		explicit append_puts(rocksdb::WriteBatch &to) : to(to) {}
+
+		void Put(rocksdb::Slice const &key, rocksdb::Slice const &value) override
+		{
+			to.Put(key, value);
+		}
+
+		rocksdb::WriteBatch &to;
+	};
+} // namespace
+
+GroupCommit::GroupCommit(rocksdb::DB &db, rocksdb::WriteOptions write_options)
+	: db(db), write_options(write_options)
+{
+	writer = std::thread(&GroupCommit::run, this);
+}
+
+GroupCommit::~GroupCommit()
+{
+	{
+		std::lock_guard<std::mutex> l(queue_mtx);
+		stopping = true;
+	}
+	work_ready.notify_one();
+	writer.join();
+	fmt::print("[{}] commits={} requests={} puts={}\n", __func__, no_commits, no_requests, no_puts);
+}
+
+auto GroupCommit::staged() -> rocksdb::WriteBatch &
+{
+	thread_local rocksdb::WriteBatch batch;
+	return batch;
+}
+
+auto GroupCommit::staged_values() -> std::unordered_map<int, std::string> &
+{
+	thread_local std::unordered_map<int, std::string> values;
+	return values;
+}
+
+void GroupCommit::stage(int key, std::string_view value)
+{
+	staged().Put(EncodedKey(key), rocksdb::Slice(value.data(), value.size()));
+	staged_values().insert_or_assign(key, std::string(value));
+}
+
+auto GroupCommit::staged_value(int key) -> std::optional<std::string_view>
+{
+	auto const &values = staged_values();
+	if (values.empty())
+		return std::nullopt;
+	auto it = values.find(key);
+	if (it == values.end())
+		return std::nullopt;
+	return it->second;
+}
+
+auto GroupCommit::commit(rocksdb::WriteBatch::Handler *on_committed) -> rocksdb::Status
+{
+	auto &batch = staged();
+	if (batch.Count() == 0)
+		return rocksdb::Status::OK();
+
+	request req{&batch, on_committed, rocksdb::Status::OK(), false};
+	{
+		std::unique_lock<std::mutex> l(queue_mtx);
+		queue.push_back(&req);
+		if (queue.size() == 1)
+			work_ready.notify_one();
+		committed.wait(l, [&req]
+					   { return req.done; });
+	}
+	batch.Clear();
+	staged_values().clear();
+	return req.status;
+}
+
+void GroupCommit::run()
+{
+	std::vector<request *> group;
+	std::unique_lock<std::mutex> l(queue_mtx);
+	while (true)
+	{
+		work_ready.wait(l, [this]
+						{ return stopping || !queue.empty(); });
+		if (queue.empty())
+			break; // stopping, and nobody is left waiting
+		group.swap(queue);
+		l.unlock();
+
+		rocksdb::Status rock_s;
+		if (group.size() == 1)
+		{
+			rock_s = db.Write(write_options, group.front()->batch);
+			no_puts += group.front()->batch->Count();
+		}
+		else
+		{
+			group_batch.Clear();
+			append_puts append(group_batch);
+			for (auto const *req : group)
+				req->batch->Iterate(&append);
+			rock_s = db.Write(write_options, &group_batch);
+			no_puts += group_batch.Count();
+		}
+		no_commits++;
+		no_requests += group.size();
+		// before anyone returns, so that the shown values follow RocksDB's order
+		if (rock_s.ok())
+		{
+			for (auto const *req : group)
+				if (req->on_committed != nullptr)
+					req->batch->Iterate(req->on_committed);
+		}
+
+		l.lock();
+		for (auto *req : group)
+		{
+			req->status = rock_s;
+			req->done = true;
+		}
+		group.clear();
+		committed.notify_all();
+	}
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "rocksdb/db.h"
+#include "rocksdb/write_batch.h"
+
+/**
+ ** Single writer stage for sync durability. A worker stages the PUTs of the
+ ** frames it handles and commits them once per event loop round, before
+ ** their replies go out. The writer thread takes every commit queued so far
+ ** and writes them as one WriteBatch, with one WAL write and fsync. Commits
+ ** that arrive meanwhile form the next group, so the groups grow with the
+ ** load and a lone PUT is not delayed. Until its commit, a staged PUT is
+ ** only visible to the thread that staged it, through staged_value().
+ **/
+class GroupCommit {
+public:
+  GroupCommit(rocksdb::DB &db, rocksdb::WriteOptions write_options);
+  ~GroupCommit();
+
+  GroupCommit(GroupCommit const &) = delete;
+  auto operator=(GroupCommit const &) -> GroupCommit & = delete;
+
+  // queues a put of the calling thread for its next commit()
+  static void stage(int key, std::string_view value);
+
+  // the value the calling thread staged last for key, if not committed yet
+  static auto staged_value(int key) -> std::optional<std::string_view>;
+
+  // returns once the puts staged by the calling thread are in RocksDB; if
+  // they made it, the writer thread first shows each of them to
+  // on_committed, in the order of the commits
+  auto commit(rocksdb::WriteBatch::Handler *on_committed = nullptr)
+      -> rocksdb::Status;
+
+private:
+  struct request {
+    rocksdb::WriteBatch *batch;
+    rocksdb::WriteBatch::Handler *on_committed;
+    rocksdb::Status status;
+    bool done = false;
+  };
+
+  static auto staged() -> rocksdb::WriteBatch &;
+  static auto staged_values() -> std::unordered_map<int, std::string> &;
+  void run();
+
+  rocksdb::DB &db;
+  rocksdb::WriteOptions write_options;
+
+  std::mutex queue_mtx; // lock for queue, the requests in it and stopping
+  std::condition_variable work_ready;
+  std::condition_variable committed;
+  std::vector<request *> queue;
+  bool stopping = false;
+
+  // only touched by the writer thread
+  rocksdb::WriteBatch group_batch;
+  uint64_t no_commits = 0;
+  uint64_t no_requests = 0;
+  uint64_t no_puts = 0;
+
+  std::thread writer;
+};
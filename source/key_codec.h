@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <cstring>
+#include <optional>
+#include <string>
+
+#include "rocksdb/comparator.h"
+#include "rocksdb/db.h"
+#include "rocksdb/slice.h"
+
+/**
+ ** RocksDB form of an int key: 4 bytes, big-endian, with the sign bit
+ ** flipped. Byte order is numeric order (negative keys first), so key ranges
+ ** can be scanned and moved in order.
+ **/
+class EncodedKey {
+public:
+  static constexpr size_t size = sizeof(uint32_t);
+
+  explicit EncodedKey(int key) noexcept {
+    auto tmp = __builtin_bswap32(static_cast<uint32_t>(key) ^ sign_bit);
+    memcpy(bytes.data(), &tmp, size);
+  }
+
+  // NOLINTNEXTLINE(google-explicit-constructor)
+  operator rocksdb::Slice() const { return {bytes.data(), size}; }
+
+  static auto decode(rocksdb::Slice encoded) -> std::optional<int> {
+    if (encoded.size() != size) {
+      return std::nullopt;
+    }
+    return static_cast<int>(load(encoded.data()) ^ sign_bit);
+  }
+
+  // the big-endian bytes as an unsigned number, which orders like the keys
+  static auto load(char const *encoded) -> uint32_t {
+    uint32_t tmp = 0;
+    memcpy(&tmp, encoded, size);
+    return __builtin_bswap32(tmp);
+  }
+
+private:
+  static constexpr uint32_t sign_bit = 0x80000000U;
+
+  std::array<char, size> bytes{};
+};
+
+/**
+ ** Orders EncodedKeys with one integer comparison instead of a byte-wise
+ ** memcmp. It gives the same order as the bytewise comparator, for any keys,
+ ** so it never shortens keys for index blocks and can read old DBs too.
+ **/
+class KeyComparator : public rocksdb::Comparator {
+public:
+  [[nodiscard]] auto Name() const -> char const * override {
+    return "clt-svr.EncodedKeyComparator";
+  }
+
+  [[nodiscard]] auto Compare(rocksdb::Slice const &a,
+                             rocksdb::Slice const &b) const -> int override {
+    if (a.size() != EncodedKey::size || b.size() != EncodedKey::size) {
+      return a.compare(b);
+    }
+    auto lhs = EncodedKey::load(a.data());
+    auto rhs = EncodedKey::load(b.data());
+    return lhs < rhs ? -1 : (lhs > rhs ? 1 : 0);
+  }
+
+  void FindShortestSeparator(std::string * /*start*/,
+                             rocksdb::Slice const & /*limit*/) const override {}
+  void FindShortSuccessor(std::string * /*key*/) const override {}
+
+  static auto get() -> KeyComparator const * {
+    static KeyComparator comparator;
+    return &comparator;
+  }
+};
+
+// the int of a key from before EncodedKeys, which were std::to_string(key)
+inline auto parse_decimal_key(rocksdb::Slice key) -> std::optional<int> {
+  int value = 0;
+  auto const *end = key.data() + key.size();
+  auto [ptr, ec] = std::from_chars(key.data(), end, value);
+  if (ec != std::errc() || ptr != end) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+/**
+ ** Whether db still has decimal keys and needs migrate-keys. RocksDB only
+ ** records the comparator name from the second open of a DB on, so the keys
+ ** tell: the first EncodedKey of any realistic key range starts with a 0x7f
+ ** or 0x80 byte, never with a digit or '-'.
+ **/
+inline auto holds_decimal_keys(rocksdb::DB &db) -> bool {
+  rocksdb::ReadOptions read_options;
+  read_options.total_order_seek = true; // also with a hash index
+  std::unique_ptr<rocksdb::Iterator> it(db.NewIterator(read_options));
+  it->SeekToFirst();
+  return it->Valid() && parse_decimal_key(it->key()).has_value();
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <memory>
 #include <mutex>
 #include <optional>
@@ -8,32 +11,127 @@
 
 #include <fmt/printf.h>
 
+#include "flat_table.h"
+#include "s3_fifo.h"
+
 #include "rocksdb/db.h"
 #include "rocksdb/options.h"
 #include "rocksdb/slice.h"
 
 using namespace rocksdb;
 
+/**
+ ** In-memory key-value map, split into stripes that each have their own
+ ** lock and FlatTable. A key's stripe comes from a multiplicative hash of the
+ ** key, so workers that write different keys rarely wait on each other.
+ ** Transaction commits lock every stripe to stay atomic. Reads take no lock
+ ** at all; the FlatTable and Epoch keep what they read alive.
+ **
+ ** With a byte limit, every stripe gets an equal share of it and evicts
+ ** keys in S3-FIFO order once a write takes it over its share. The server
+ ** only puts values here that are durable or held by the write-back, so an
+ ** evicted key can always be read again.
+ **/
 class KvStore {
 public:
-  static inline auto init() -> std::shared_ptr<KvStore> {
-    return std::make_shared<KvStore>();
+  // cache_bytes of 0 means no limit
+  static inline auto init(size_t cache_bytes = 0) -> std::shared_ptr<KvStore> {
+    return std::make_shared<KvStore>(cache_bytes);
+  }
+
+  explicit KvStore(size_t cache_bytes = 0)
+      : stripe_budget(cache_bytes / no_stripes),
+        base_version(no_stores.fetch_add(1, std::memory_order_relaxed)
+                     << store_version_bits) {
+    // a limit below one byte per stripe still is a limit
+    if (cache_bytes > 0 && stripe_budget == 0) {
+      stripe_budget = 1;
+    }
+    for (auto &stripe : stripes) {
+      stripe.version.store(base_version, std::memory_order_relaxed);
+    }
   }
 
   inline auto put(int key, std::string_view value) -> bool {
-    std::lock_guard<std::mutex> l(db_mtx);
-    no_keys++;
-    kv_store.insert_or_assign(key, value);
+    auto &stripe = stripe_of(key);
+    std::lock_guard<std::mutex> l(stripe.mtx);
+    no_keys.fetch_add(1, std::memory_order_relaxed);
+    replacing(stripe);
+    written(stripe, key, stripe.kv_store.insert_or_assign(key, value));
+    return true;
+  }
+
+  /**
+   ** For a value read from behind the store, e.g. RocksDB: version_of(key)
+   ** before the read and admit() after it. The version changes with every
+   ** write and erase in the key's stripe, so admit() turns the value down
+   ** if a newer one may have been put and evicted meanwhile. The versions
+   ** of two stores never match.
+   **/
+  [[nodiscard]] auto version_of(int key) const -> uint64_t {
+    return stripe_of(key).version.load(std::memory_order_seq_cst);
+  }
+
+  // the version of every stripe before the first write
+  [[nodiscard]] auto first_version() const -> uint64_t { return base_version; }
+
+  // leaves a present key alone
+  inline auto admit(int key, std::string_view value, uint64_t version)
+      -> bool {
+    auto &stripe = stripe_of(key);
+    std::lock_guard<std::mutex> l(stripe.mtx);
+    if (stripe.version.load(std::memory_order_relaxed) != version ||
+        !stripe.kv_store.try_emplace(key, value)) {
+      return false;
+    }
+    no_keys.fetch_add(1, std::memory_order_relaxed);
+    written(stripe, key, true);
+    return true;
+  }
+
+  // the eviction order skips the key once it gets to it
+  inline auto erase(int key) -> bool {
+    auto &stripe = stripe_of(key);
+    std::lock_guard<std::mutex> l(stripe.mtx);
+    replacing(stripe);
+    if (!stripe.kv_store.erase(key)) {
+      return false;
+    }
+    stripe.bytes.store(stripe.kv_store.memory_usage() +
+                           stripe.eviction.memory_usage(),
+                       std::memory_order_relaxed);
     return true;
   }
 
+  [[nodiscard]] auto bounded() const -> bool { return stripe_budget > 0; }
+
+  [[nodiscard]] auto evictions() const -> uint64_t {
+    return no_evictions.load(std::memory_order_relaxed);
+  }
+
+  // table slots, values and eviction queues of all stripes, in bytes
+  [[nodiscard]] auto resident_bytes() const -> size_t {
+    size_t bytes = 0;
+    for (auto const &stripe : stripes) {
+      bytes += stripe.bytes.load(std::memory_order_relaxed);
+    }
+    return bytes;
+  }
+
+  // lock-free; the view is valid while the caller holds an Epoch::Guard
   inline auto get(int key) const -> std::optional<std::string_view> {
-    std::lock_guard<std::mutex> l(db_mtx);
-    auto it = kv_store.find(key);
-    if (it == kv_store.end()) {
-      return std::nullopt;
+    return stripe_of(key).kv_store.find(key);
+  }
+
+  // lock-free, copies the value before a concurrent put can retire it
+  inline auto get(int key, std::string *value) const -> bool {
+    Epoch::Guard guard;
+    auto bytes = stripe_of(key).kv_store.find(key);
+    if (!bytes) {
+      return false;
     }
-    return it->second;
+    value->assign(*bytes);
+    return true;
   }
 
   inline auto tx_start(int tx_id) -> bool {
@@ -57,12 +155,6 @@ public:
     return true;
   }
 
-  inline auto safe_get(int key) -> std::string_view {
-    std::lock_guard<std::mutex> l(db_mtx);
-    auto it = kv_store.find(key);
-    return it->second;
-  }
-
   inline auto tx_get(int tx_id, int key) -> std::tuple<bool, std::string> {
     std::lock_guard<std::mutex> l(gets_mtx);
 
@@ -75,20 +167,28 @@ public:
       }
     }
 
-    auto ret_val = std::string{safe_get(key)};
+    std::string ret_val;
+    get(key, &ret_val);
     auto &tx_keys = locked_keys[tx_id];
     tx_keys.push_back(key);
     return std::tuple{true, ret_val};
   }
 
+  // the caller holds the lock of the key's stripe
   inline auto unsafe_put(int key, std::string_view value) -> bool {
-    kv_store.insert_or_assign(key, value);
+    auto &stripe = stripe_of(key);
+    replacing(stripe);
+    written(stripe, key, stripe.kv_store.insert_or_assign(key, value));
     return true;
   }
 
   inline auto tx_commit(int tx_id) -> bool {
     std::lock_guard<std::mutex> lock_txs(txs_mtx);
-    std::lock_guard<std::mutex> lock_db(db_mtx);
+    // in stripe order, like every other taker of several stripe locks
+    std::array<std::unique_lock<std::mutex>, no_stripes> lock_db;
+    for (size_t i = 0; i < no_stripes; i++) {
+      lock_db[i] = std::unique_lock<std::mutex>(stripes[i].mtx);
+    }
     auto cur_tx = live_txs[tx_id];
     for (auto &update : cur_tx) {
       unsafe_put(update.first, update.second);
@@ -109,29 +209,89 @@ public:
     return true;
   }
 
-  ~KvStore() { fmt::print("[{}] no_keys={}\n", __func__, no_keys); }
+  ~KvStore() {
+    fmt::print("[{}] no_keys={}\n", __func__,
+               no_keys.load(std::memory_order_relaxed));
+  }
 
-  void init_it() { it = kv_store.begin(); }
+  // iterates stripe by stripe, over a store that no one writes into any
+  // more; the caller holds an Epoch::Guard from init_it() to the last key
+  void init_it() {
+    it_stripe = 0;
+    it = stripes[0].kv_store.begin();
+  }
 
   auto get_next_key() -> int {
-    if (it != kv_store.end()) {
-      auto ret = it->first;
-      it++;
-      return ret;
+    while (it == stripes[it_stripe].kv_store.end()) {
+      if (it_stripe + 1 == no_stripes) {
+        return -1;
+      }
+      it = stripes[++it_stripe].kv_store.begin();
     }
-    return -1;
+    auto ret = it.key();
+    ++it;
+    return ret;
   }
 
 private:
-  mutable std::mutex db_mtx; // lock for the kv_store
-  std::unordered_map<int, std::string> kv_store;
-  std::unordered_map<int, std::string>::iterator it;
+  static constexpr size_t stripe_bits = 6;
+  static constexpr size_t no_stripes = size_t{1} << stripe_bits;
+
+  // the low bits of a version count the writes, the high ones the store
+  static constexpr int store_version_bits = 40;
+  static inline std::atomic<uint64_t> no_stores{0};
+
+  // own cache lines, so that two stripes' locks do not bounce together
+  struct alignas(64) Stripe {
+    mutable std::mutex mtx; // serializes the kv_store writers
+    FlatTable kv_store;
+    S3Fifo eviction; // only used with a limit
+    std::atomic<size_t> bytes{0};
+    std::atomic<uint64_t> version{0}; // see version_of()
+  };
+
+  // the caller holds the stripe lock, before a write or an erase
+  static void replacing(Stripe &stripe) {
+    stripe.version.fetch_add(1, std::memory_order_seq_cst);
+  }
+
+  // the caller holds the stripe lock; inserted if key is new to the stripe
+  void written(Stripe &stripe, int key, bool inserted) {
+    if (bounded()) {
+      if (inserted) {
+        stripe.eviction.inserted(stripe.kv_store, key);
+      }
+      if (auto evicted = stripe.eviction.evict(stripe.kv_store, stripe_budget);
+          evicted > 0) {
+        no_evictions.fetch_add(evicted, std::memory_order_relaxed);
+      }
+    }
+    stripe.bytes.store(stripe.kv_store.memory_usage() +
+                           stripe.eviction.memory_usage(),
+                       std::memory_order_relaxed);
+  }
+
+  // the top bits of a Fibonacci hash, so that consecutive keys spread out
+  static auto stripe_index(int key) -> size_t {
+    return (static_cast<uint32_t>(key) * 0x9E3779B1U) >> (32 - stripe_bits);
+  }
+  auto stripe_of(int key) -> Stripe & { return stripes[stripe_index(key)]; }
+  auto stripe_of(int key) const -> Stripe const & {
+    return stripes[stripe_index(key)];
+  }
+
+  std::array<Stripe, no_stripes> stripes;
+  size_t it_stripe = 0;
+  FlatTable::iterator it;
 
   mutable std::mutex txs_mtx; // lock for the txs
   using local_tx_buf = std::unordered_map<int, std::string>;
   std::unordered_map<int, local_tx_buf> live_txs;
 
-  uint64_t no_keys = 0;
+  std::atomic<uint64_t> no_keys{0};
+  size_t stripe_budget; // bytes per stripe, 0 without a limit
+  uint64_t base_version;
+  std::atomic<uint64_t> no_evictions{0};
 
   mutable std::mutex gets_mtx; // lock for the txs
   using tx_keys = std::vector<int>;
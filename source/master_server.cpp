@@ -5,123 +5,180 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <map>
+#include <random>
 #include <thread>
 #include <vector>
 #include <mutex>
 
-#include "kv_store.h"
+#include "frame_reader.h"
 #include "message.h"
+#include "rebalancer.h"
+#include "routing_table.h"
 #include "shared.h"
 
-void handle_client(int sockfd, sockets::client_msg message);
+void send_routing_table(int sockfd, sockets::client_msg::OperationData const &request);
 void manage_server();
-std::map<int, int> map_fds;
-int port, master_port, server_fd, num_servers = 0, counter = 0;
+// the shards in the order they joined; clients route with a copy of it
+RoutingTable routing_table;
+// set up in main from the options
+std::unique_ptr<Rebalancer> rebalancer;
+int port, master_port, server_fd;
+uint64_t printed_epoch = 0;
 std::string server_address;
-std::shared_ptr<KvStore> local_kv;
 struct sockaddr_in svr_addr;
-bool started = false;
-std::vector<int> connections;
-std::mutex m;
-bool manage_block = false;
+// hand-off from the acceptor to manage_server
+ConnectionQueue connections{1024};
 
 struct timeval timeout;
 
-class MasterServer
+// the buckets that port takes over from shards that are still there to
+// hand their keys over
+void add_incoming(sockets::client_msg *msg, std::vector<BucketMap::Move> const &moves, int port, int skip_port)
 {
-	std::shared_ptr<KvStore> local_kv;
-
-public:
-	MasterServer()
+	for (auto const &move : moves)
 	{
-		local_kv = KvStore::init();
-		local_kv->init_it();
+		if (move.to != port || move.from == 0 || move.from == skip_port)
+			continue;
+		msg->add_incoming_buckets(move.bucket);
+		msg->add_incoming_from(move.from);
 	}
-};
+}
 
-void redistribute()
+/**
+ ** Pushes the new routing table to every shard but the one on skip_port, so
+ ** that they turn away the keys they no longer own. A shard that lost
+ ** buckets gets it with a TXN_START and hands their keys over; a shard that
+ ** gained some learns where they come from. The ones that hand over go
+ ** first, so that no shard takes a PUT for a bucket whose keys already left.
+ ** Until a new owner has the table too, it sends a PUT for such a bucket
+ ** back to the old owner with WRONG_SHARD, and the old owner sends it on
+ ** again; the client gives up after its redirects, so a PUT can fail in
+ ** that window.
+ **/
+void redistribute(std::vector<BucketMap::Move> const &moves, int skip_port)
 {
-	fmt::print("blocking manage\n");
-	manage_block = true;
-	int server_port, server_fd;
-	local_kv = KvStore::init();
-	for (auto it = map_fds.begin(); it != std::prev(map_fds.end()); it++)
+	std::map<int, std::vector<uint32_t>> moved_from;
+	for (auto const &move : moves)
+	{
+		if (move.from != 0)
+			moved_from[move.from].push_back(move.bucket);
+	}
+	fmt::print("  {} of {} buckets move\n", moves.size(), BucketMap::no_buckets);
+
+	for (bool handing_over : {true, false})
 	{
-		sockets::client_msg msg;
-		auto *operation_data = msg.add_ops();
-		operation_data->set_type(sockets::client_msg_OperationType_TXN_START);
-		server_port = it->second;
-		server_fd = connect_to(server_port, server_address, 0, 0);
-		connections.push_back(server_fd);
-		send_clt_message(server_fd, msg);
-		fmt::print("  notified and pushed {} at {}\n", server_port, server_fd);
-		// sleep(1);
+		for (int server_port : routing_table.ports())
+		{
+			auto moved = moved_from.find(server_port);
+			if (server_port == skip_port || (moved != moved_from.end()) != handing_over)
+				continue;
+			sockets::client_msg msg;
+			auto *operation_data = msg.add_ops();
+			routing_table.to_message(msg.mutable_routing());
+			add_incoming(&msg, moves, server_port, skip_port);
+			if (moved == moved_from.end())
+				operation_data->set_type(sockets::client_msg_OperationType_ROUTE);
+			else
+			{
+				operation_data->set_type(sockets::client_msg_OperationType_TXN_START);
+				msg.mutable_moved_buckets()->Assign(moved->second.begin(), moved->second.end());
+			}
+			int server_fd = try_connect_to(server_port, server_address, 3);
+			if (server_fd < 0)
+			{
+				fmt::print("  {} NOT reachable\n", server_port);
+				continue;
+			}
+			send_clt_message(server_fd, msg);
+			close_socket(server_fd, 0);
+			fmt::print("  notified {} of epoch {}, {} buckets to hand over\n", server_port, routing_table.epoch(),
+					   moved == moved_from.end() ? 0 : moved->second.size());
+		}
 	}
-	fmt::print("unblocked manage\n");
-	// usleep(5 * 1000);
-	manage_block = false;
+}
+
+// records the load of a shard and moves buckets off the hottest one
+void handle_heartbeat(sockets::client_msg::ShardLoad const &load)
+{
+	fmt::print("LOAD < {}: {:.1f} qps, p99 {} us, {} keys, {:.1f} MiB >\n", load.port(), load.qps(), load.p99_us(), load.keys(),
+			   load.bytes() / (1024.0 * 1024.0));
+	Rebalancer::Load reported{load.qps(), {}};
+	for (int i = 0; i < std::min(load.hot_buckets_size(), load.hot_qps_size()); i++)
+		reported.hot_buckets.emplace_back(load.hot_buckets(i), load.hot_qps(i));
+	rebalancer->report(load.port(), std::move(reported));
+
+	auto plans = rebalancer->plan(routing_table.buckets(), routing_table.ports(), Rebalancer::Clock::now());
+	if (plans.empty())
+		return;
+	std::vector<std::pair<uint32_t, int>> buckets;
+	for (auto const &plan : plans)
+		buckets.emplace_back(plan.bucket, plan.to);
+	auto moves = routing_table.assign(buckets);
+	fmt::print("\n---rebalancing---\n");
+	for (auto const &move : moves)
+		fmt::print("  bucket {} from {} to {}\n", move.bucket, move.from, move.to);
+	redistribute(moves, 0);
 }
 
 void handle_connection(int connected_fd)
 {
 	sockets::client_msg msg;
-	char tmp[1] = "";
+	FrameReader reader;
 
-	while (true)
-	{
-		setsockopt(connected_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+	setsockopt(connected_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
 
-		if (recv(connected_fd, tmp, 1, MSG_PEEK) <= 0)
+	// ends on EOF, on error or when the peer is silent for longer than the timeout
+	while (auto frame = reader.read_frame(connected_fd))
+	{
+		if (!msg.ParseFromArray(frame->data(), frame->size()) || msg.ops_size() == 0)
 		{
-			// fmt::print("Break!\n");
+			fmt::print("[{}] ParseFromArray\n", __func__);
 			break;
 		}
 
-		recv_clt_message(connected_fd, &msg);
-
 		if (msg.ops(0).type() == sockets::client_msg_OperationType_INIT)
 		{
-			map_fds.insert({1 + num_servers++, msg.ops(0).port()});
-
-			if (started)
-			{
-				fmt::print("\n---redistribution---\n");
-				redistribute();
-				started = false;
-			}
+			int joined_port = msg.ops(0).port();
+			auto moves = routing_table.add(joined_port);
+
+			fmt::print("\n---redistribution---\n");
+			redistribute(moves, joined_port);
+			// the new shard learns what it owns before it serves anything
+			sockets::client_msg reply;
+			routing_table.to_message(reply.mutable_routing());
+			add_incoming(&reply, moves, joined_port, 0);
+			send_clt_message(connected_fd, reply);
+		}
+		else if (msg.ops(0).type() == sockets::client_msg_OperationType_HEARTBEAT && msg.has_load())
+		{
+			handle_heartbeat(msg.load());
 		}
-		else if (msg.ops(0).has_type())
+		else if (msg.ops(0).type() == sockets::client_msg_OperationType_ROUTE)
 		{
 			// msg.PrintDebugString();
 			// fmt::print("\nClient detected:\n");
-			started = true;
-			handle_client(connected_fd, msg);
+			send_routing_table(connected_fd, msg.ops(0));
 		}
 		else
 		{
-			printf("No type..\n");
+			// clients route their operations themselves
+			fmt::print("Unexpected operation {}..\n", static_cast<int>(msg.ops(0).type()));
 			break;
 		}
 	}
 	close_socket(connected_fd, 0);
 }
 
-void handle_client(int sockfd, sockets::client_msg message)
+// the moves since the client's epoch, if it sent one of this cluster
+void send_routing_table(int sockfd, sockets::client_msg::OperationData const &request)
 {
-	int key = message.ops(0).key();
-	std::string value = message.ops(0).value();
-	local_kv->put(key, value); // mirror
-
-	int shard = (key % num_servers) + 1;
-	auto in = map_fds.find(shard);
-	int server_port = in->second;
-
-	fmt::print("Forwarding {} to {} with port {}..\n", key, shard, server_port);
+	fmt::print("Sending routing table of epoch {}..\n", routing_table.epoch());
 
 	sockets::client_msg client_msg;
-	auto *operation_data = client_msg.add_ops();
-	operation_data->set_type(sockets::client_msg::INIT);
-	operation_data->set_port(server_port);
+	bool known = request.has_epoch() && request.cluster() == routing_table.cluster();
+	routing_table.to_message(client_msg.mutable_routing(),
+							 known ? std::optional<uint64_t>(request.epoch()) : std::nullopt);
 	// client_msg.PrintDebugString();
 	send_clt_message(sockfd, client_msg);
 }
@@ -130,27 +187,20 @@ void manage_server()
 {
 	while (true)
 	{
-		if (!connections.empty() && !manage_block)
-		{
-			m.lock();
-			int connected_fd = connections.back();
-			connections.pop_back();
-			m.unlock();
-
-			handle_connection(connected_fd);
-		}
+		// blocks on the queue's eventfd until the acceptor hands over a fd
+		int connected_fd = connections.pop();
+		handle_connection(connected_fd);
 
-		if (num_servers != counter) // >
+		if (routing_table.epoch() != printed_epoch)
 		{
+			auto const &ports = routing_table.ports();
 			fmt::print("\n------------------------------\n");
-			fmt::print("Current cluster of {} servers:\n", num_servers);
-			for (auto it = map_fds.begin(); it != map_fds.end(); ++it)
-				fmt::print("  < {} - {} >\n", it->first, it->second);
+			fmt::print("Current cluster of {} servers, epoch {}:\n", ports.size(), routing_table.epoch());
+			for (size_t i = 0; i < ports.size(); i++)
+				fmt::print("  < {} - {} > {} buckets\n", i + 1, ports[i], routing_table.buckets().buckets_of(ports[i]));
 			fmt::print("------------------------------\n");
-			counter = num_servers; // counter++;
+			printed_epoch = routing_table.epoch();
 		}
-
-		usleep(5 * 1000);
 	}
 }
 
@@ -167,20 +217,21 @@ void check_health()
 	while (true)
 	{
 		sleep(10);
-		int server_port;
-		for (auto it = map_fds.begin(); it != map_fds.end(); it++)
+		// a copy, the unreachable ones leave the table
+		auto ports = routing_table.ports();
+		for (int server_port : ports)
 		{
-			server_port = it->second;
-			server_fd = connect_to(server_port, server_address, 0, 3);
+			server_fd = try_connect_to(server_port, server_address, 3);
 			if (server_fd > 0)
 			{
 				fmt::print("--- Server on {} OK\n", server_port);
+				close_socket(server_fd, 0);
 			}
 			else
 			{
 				fmt::print("--- Server on {} NOT reachable\n", server_port);
-				map_fds.erase(it->first);
-				num_servers--;
+				rebalancer->forget(server_port);
+				redistribute(routing_table.remove(server_port), server_port);
 			}
 		}
 	}
@@ -199,7 +250,7 @@ void check_health()
 int main(int argc, char const *argv[])
 {
 	cxxopts::Options options(argv[0], "Master server");
-	options.allow_unrecognised_options().add_options()("p,MASTER_PORT", "port at which the master listens to for client requests and new servers joining the cluster", cxxopts::value<size_t>())("h,help", "Print help");
+	options.allow_unrecognised_options().add_options()("p,MASTER_PORT", "port at which the master listens to for client requests and new servers joining the cluster", cxxopts::value<size_t>())("rebalance-ratio", "a server is hot once its QPS is above this many times the mean; its busiest buckets then move to the coldest server", cxxopts::value<double>()->default_value("1.5"))("rebalance-min-qps", "a server below this QPS is never hot", cxxopts::value<double>()->default_value("100"))("rebalance-moves", "buckets moved per minute at most by the rebalancing, 0 for none", cxxopts::value<size_t>()->default_value("32"))("h,help", "Print help");
 
 	auto args = options.parse(argc, argv);
 
@@ -218,12 +269,13 @@ int main(int argc, char const *argv[])
 	master_port = args["MASTER_PORT"].as<size_t>();
 	server_address = "127.0.0.1";
 
-	std::vector<std::thread> threads;
-	// MasterServer *masterOP;
+	rebalancer = std::make_unique<Rebalancer>(Rebalancer::Options{
+		args["rebalance-ratio"].as<double>(), args["rebalance-min-qps"].as<double>(), args["rebalance-moves"].as<size_t>()});
 
-	local_kv = KvStore::init();
-	local_kv->init_it();
+	std::random_device random;
+	routing_table = RoutingTable((static_cast<uint64_t>(random()) << 32) | random());
 
+	std::vector<std::thread> threads;
 	timeout.tv_sec = 3;
 	timeout.tv_usec = 0;
 
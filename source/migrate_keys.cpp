@@ -0,0 +1,149 @@
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <tuple>
+
+#include <cxxopts.hpp>
+#include <fmt/printf.h>
+
+#include "key_codec.h"
+
+#include "rocksdb/db.h"
+#include "rocksdb/options.h"
+#include "rocksdb/write_batch.h"
+
+/**
+ ** One-shot migration of the rockDBs/sub_DB_* directories from decimal
+ ** string keys (std::to_string(key)) to EncodedKeys. Every DB is copied into
+ ** a fresh one created with the KeyComparator, which then takes its place;
+ ** the old one stays next to it as sub_DB_<i>.decimal-keys.
+ **/
+
+static constexpr auto keys_per_batch = 1000;
+
+static auto open_db(rocksdb::Options const &options, std::string const &path, bool read_only)
+	-> std::pair<rocksdb::Status, std::unique_ptr<rocksdb::DB>>
+{
+	rocksdb::DB *db = nullptr;
+	auto rock_s = read_only ? rocksdb::DB::OpenForReadOnly(options, path, &db) : rocksdb::DB::Open(options, path, &db);
+	return {rock_s, std::unique_ptr<rocksdb::DB>(db)};
+}
+
+// false if the directory could not be migrated
+static bool migrate(std::filesystem::path const &dir)
+{
+	rocksdb::Options encoded_options;
+	encoded_options.comparator = KeyComparator::get();
+
+	// both comparators order the old keys alike, the MANIFEST may name either
+	auto [rock_s, old_db] = open_db(encoded_options, dir, true);
+	if (rock_s.IsInvalidArgument())
+		std::tie(rock_s, old_db) = open_db(rocksdb::Options(), dir, true);
+	if (!rock_s.ok())
+	{
+		// an empty directory is fine, the server creates its DB
+		bool has_db = std::filesystem::exists(dir / "CURRENT");
+		fmt::print("{}: {}\n", dir.string(), has_db ? rock_s.ToString() : "no DB");
+		return !has_db;
+	}
+	if (!holds_decimal_keys(*old_db))
+	{
+		fmt::print("{}: already migrated\n", dir.string());
+		return true;
+	}
+
+	auto tmp_dir = dir.string() + ".migrating";
+	std::filesystem::remove_all(tmp_dir);
+	encoded_options.create_if_missing = true;
+	encoded_options.error_if_exists = true;
+	auto [new_s, new_db] = open_db(encoded_options, tmp_dir, false);
+	if (!new_s.ok())
+	{
+		fmt::print("{}: {}\n", tmp_dir, new_s.ToString());
+		return false;
+	}
+
+	size_t no_keys = 0;
+	size_t no_skipped = 0;
+	rocksdb::WriteBatch write_batch;
+	std::unique_ptr<rocksdb::Iterator> it(old_db->NewIterator(rocksdb::ReadOptions()));
+	for (it->SeekToFirst(); it->Valid(); it->Next())
+	{
+		auto key = parse_decimal_key(it->key());
+		if (!key)
+		{
+			fmt::print("{}: skipping the non-decimal key '{}'\n", dir.string(), it->key().ToString());
+			no_skipped++;
+			continue;
+		}
+		write_batch.Put(EncodedKey(*key), it->value());
+		if (++no_keys % keys_per_batch == 0)
+		{
+			new_s = new_db->Write(rocksdb::WriteOptions(), &write_batch);
+			write_batch.Clear();
+		}
+		if (!new_s.ok())
+			break;
+	}
+	if (new_s.ok() && write_batch.Count() > 0)
+		new_s = new_db->Write(rocksdb::WriteOptions(), &write_batch);
+	if (new_s.ok())
+		new_s = it->status();
+	if (new_s.ok())
+		new_s = new_db->Flush(rocksdb::FlushOptions());
+
+	it.reset();
+	old_db.reset();
+	new_db.reset();
+
+	if (!new_s.ok())
+	{
+		fmt::print("{}: {}, left untouched\n", dir.string(), new_s.ToString());
+		std::filesystem::remove_all(tmp_dir);
+		return false;
+	}
+
+	// the placeholder that keeps the directory in git moves along
+	if (std::filesystem::exists(dir / ".gitignore"))
+		std::filesystem::rename(dir / ".gitignore", std::filesystem::path(tmp_dir) / ".gitignore");
+
+	auto backup_dir = dir.string() + ".decimal-keys";
+	std::filesystem::remove_all(backup_dir);
+	std::filesystem::rename(dir, backup_dir);
+	std::filesystem::rename(tmp_dir, dir);
+	fmt::print("{}: {} keys migrated, {} skipped, old DB kept in {}\n", dir.string(), no_keys, no_skipped, backup_dir);
+	return true;
+}
+
+auto main(int argc, char *argv[]) -> int
+{
+	cxxopts::Options options(argv[0], "Migrates the server DBs to fixed-width binary keys");
+	options.allow_unrecognised_options().add_options()("d,DIR", "directory holding the sub_DB_* DBs", cxxopts::value<std::string>()->default_value("rockDBs"))("h,help", "Print help");
+
+	auto args = options.parse(argc, argv);
+
+	if (args.count("help"))
+	{
+		fmt::print("{}\n", options.help());
+		return 0;
+	}
+
+	std::filesystem::path root = args["DIR"].as<std::string>();
+	if (!std::filesystem::is_directory(root))
+	{
+		fmt::print(stderr, "{} is not a directory\n{}\n", root.string(), options.help());
+		return 1;
+	}
+
+	int failed = 0;
+	for (auto const &entry : std::filesystem::directory_iterator(root))
+	{
+		auto name = entry.path().filename().string();
+		if (!entry.is_directory() || !name.starts_with("sub_DB_") || name.find('.') != std::string::npos)
+			continue;
+		if (!migrate(entry.path()))
+			failed++;
+	}
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <thread>
+
+#include <fmt/printf.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/**
+ ** Bounded lock-free multi-producer/multi-consumer queue (D. Vyukov's
+ ** sequence-numbered ring). try_push()/try_pop() never block; push()/pop()
+ ** block on an eventfd semaphore instead of polling, one count per element.
+ ** The eventfd can also be registered in an epoll set.
+ **/
+template <class T> class MpmcQueue {
+public:
+  explicit MpmcQueue(size_t min_capacity)
+      : mask(round_up_pow2(min_capacity) - 1),
+        cells(std::make_unique<cell[]>(mask + 1)) {
+    for (size_t i = 0; i <= mask; i++) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    if ((event_fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC)) == -1) {
+      fmt::print("eventfd\n");
+      // NOLINTNEXTLINE(concurrency-mt-unsafe)
+      exit(1);
+    }
+  }
+
+  ~MpmcQueue() { ::close(event_fd); }
+
+  MpmcQueue(MpmcQueue const &) = delete;
+  auto operator=(MpmcQueue const &) -> MpmcQueue & = delete;
+
+  inline auto try_push(T const &value) -> bool {
+    if (!enqueue(value)) {
+      return false;
+    }
+    uint64_t one = 1;
+    while (::write(event_fd, &one, sizeof(one)) == -1 && errno == EINTR) {
+    }
+    return true;
+  }
+
+  // waits for a free slot when the queue is full, nothing is dropped
+  inline void push(T const &value) {
+    while (!try_push(value)) {
+      std::this_thread::yield();
+    }
+  }
+
+  /**
+   ** Only for consumers that do not use pop(): pop() relies on one eventfd
+   ** count per element.
+   **/
+  inline auto try_pop() -> std::optional<T> { return dequeue(); }
+
+  inline auto pop() -> T {
+    uint64_t count = 0;
+    while (::read(event_fd, &count, sizeof(count)) == -1 && errno == EINTR) {
+    }
+    // the count is posted after the element is published, but an earlier
+    // slot of a slower producer may still be in flight
+    while (true) {
+      if (auto value = dequeue()) {
+        return *value;
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  [[nodiscard]] auto get_event_fd() const -> int { return event_fd; }
+
+  [[nodiscard]] auto capacity() const -> size_t { return mask + 1; }
+
+private:
+  static constexpr size_t cache_line = 64;
+
+  struct cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  static constexpr auto round_up_pow2(size_t n) -> size_t {
+    size_t res = 2;
+    while (res < n) {
+      res <<= 1U;
+    }
+    return res;
+  }
+
+  inline auto enqueue(T const &value) -> bool {
+    auto pos = enqueue_pos.load(std::memory_order_relaxed);
+    cell *c = nullptr;
+    while (true) {
+      c = &cells[pos & mask];
+      auto seq = c->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false; // full
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    c->data = value;
+    c->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  inline auto dequeue() -> std::optional<T> {
+    auto pos = dequeue_pos.load(std::memory_order_relaxed);
+    cell *c = nullptr;
+    while (true) {
+      c = &cells[pos & mask];
+      auto seq = c->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return std::nullopt; // empty
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    T value = std::move(c->data);
+    c->sequence.store(pos + mask + 1, std::memory_order_release);
+    return value;
+  }
+
+  size_t const mask;
+  std::unique_ptr<cell[]> cells;
+  int event_fd = -1;
+
+  alignas(cache_line) std::atomic<size_t> enqueue_pos{0};
+  alignas(cache_line) std::atomic<size_t> dequeue_pos{0};
+};
+
+using ConnectionQueue = MpmcQueue<int>;
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <unordered_map>
+#include <utility>
+
+#include <fmt/format.h>
+
+#include "frame_reader.h"
+#include "message.h"
+#include "shared.h"
+
+/**
+ ** Keeps up to `window` requests in flight on one connection instead of one
+ ** request per round trip. Every request is tagged with its own op_id and
+ ** the reply carrying the same op_id completes it, so the replies may arrive
+ ** in any order. Several ops can also share one client_msg (a batch), which
+ ** the server answers with one server_response.
+ **/
+class PipelinedClient {
+public:
+  using completion = std::function<void(server::server_response::reply const &)>;
+
+  PipelinedClient(int fd, size_t window)
+      : fd(fd), window(window > 0 ? window : 1) {}
+
+  /**
+   ** Sends the operation, first waiting for replies while the window is full.
+   ** It returns false if the connection broke.
+   **/
+  auto submit(sockets::client_msg::OperationData const &op,
+              completion const &on_reply) -> bool {
+    return submit_batch(std::span(&op, 1), on_reply);
+  }
+
+  /**
+   ** Sends the operations as one client_msg; on_reply is called once per op.
+   ** A batch bigger than the window waits for every earlier reply first.
+   **/
+  auto submit_batch(std::span<sockets::client_msg::OperationData const> ops,
+                    completion const &on_reply) -> bool {
+    while (!in_flight.empty() && in_flight.size() + ops.size() > window) {
+      if (!recv_one()) {
+        return false;
+      }
+    }
+
+    sockets::client_msg msg;
+    for (auto const &op : ops) {
+      auto *operation_data = msg.add_ops();
+      *operation_data = op;
+      operation_data->set_op_id(next_op_id);
+      in_flight.emplace(next_op_id++, on_reply);
+    }
+    send_clt_message(fd, msg);
+    return true;
+  }
+
+  // waits for every outstanding reply
+  auto drain() -> bool {
+    while (!in_flight.empty()) {
+      if (!recv_one()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  [[nodiscard]] auto outstanding() const -> size_t { return in_flight.size(); }
+
+private:
+  auto recv_one() -> bool {
+    // one recv() usually brings in several replies; the rest stay buffered
+    auto frame = reader.read_frame(fd);
+    if (!frame) {
+      fmt::print("[{}] connection closed with {} requests in flight\n",
+                 __func__, in_flight.size());
+      return false;
+    }
+
+    // a batch is answered by a server_response, a single op by a bare reply
+    // (which parses as a server_response without reps)
+    server::server_response response;
+    if (response.ParseFromArray(frame->data(), frame->size()) &&
+        response.reps_size() > 0) {
+      for (auto const &reply : response.reps()) {
+        if (!complete(reply)) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    server::server_response::reply reply;
+    if (!reply.ParseFromArray(frame->data(), frame->size())) {
+      fmt::print("[{}] ParseFromArray\n", __func__);
+      return false;
+    }
+    return complete(reply);
+  }
+
+  auto complete(server::server_response::reply const &reply) -> bool {
+    auto it = in_flight.find(reply.op_id());
+    if (it == in_flight.end()) {
+      fmt::print("[{}] unexpected reply op_id={}\n", __func__, reply.op_id());
+      return false;
+    }
+    auto on_reply = std::move(it->second);
+    in_flight.erase(it);
+    if (on_reply) {
+      on_reply(reply);
+    }
+    return true;
+  }
+
+  int fd;
+  size_t window;
+  FrameReader reader;
+  int32_t next_op_id = 0;
+  std::unordered_map<int32_t, completion> in_flight;
+};
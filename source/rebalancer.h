@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "bucket_map.h"
+
+/**
+ ** Moves buckets from the busiest shard to the idlest one, after the load
+ ** the shards report on their heartbeats. A shard is hot once its QPS is
+ ** above hot_ratio times the mean and above min_qps. Its busiest buckets
+ ** go to the coldest shard, one at a time, as long as that takes the hot
+ ** shard's QPS down more than it takes the cold one's up: a bucket with
+ ** more than half the gap, a hot key, would only move the hot spot.
+ **
+ ** Every move is accounted as if it had taken effect, until the next
+ ** heartbeats bring the real numbers. The moves spend a budget that refills
+ ** at max_moves_per_minute and holds at most as much.
+ **/
+class Rebalancer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    double hot_ratio = 1.5;
+    double min_qps = 100;
+    size_t max_moves_per_minute = 32; // 0 for no rebalancing
+  };
+
+  struct Load {
+    double qps = 0;
+    // the busiest buckets with their QPS, busiest first
+    std::vector<std::pair<uint32_t, double>> hot_buckets;
+  };
+
+  // a bucket to hand over
+  struct Plan {
+    uint32_t bucket;
+    int to;
+  };
+
+  explicit Rebalancer(Options options)
+      : options(options),
+        budget(static_cast<double>(options.max_moves_per_minute)) {}
+
+  void report(int port, Load load) { loads[port] = std::move(load); }
+  void forget(int port) { loads.erase(port); }
+
+  // the moves to make now; a shard without a report counts as idle
+  auto plan(BucketMap const &map, std::vector<int> const &ports,
+            Clock::time_point now) -> std::vector<Plan> {
+    std::vector<Plan> plans;
+    refill(now);
+    if (ports.size() < 2 || options.max_moves_per_minute == 0) {
+      return plans;
+    }
+    double total = 0;
+    for (int port : ports) {
+      total += loads[port].qps;
+    }
+    auto mean = total / static_cast<double>(ports.size());
+    auto by_qps = [this](int a, int b) { return loads[a].qps < loads[b].qps; };
+    int hot = *std::max_element(ports.begin(), ports.end(), by_qps);
+    auto &hot_load = loads[hot];
+
+    while (budget >= 1 && hot_load.qps > options.min_qps &&
+           hot_load.qps > mean * options.hot_ratio) {
+      int cold = *std::min_element(ports.begin(), ports.end(), by_qps);
+      auto &cold_load = loads[cold];
+      auto gap = hot_load.qps - cold_load.qps;
+      auto candidate = std::find_if(
+          hot_load.hot_buckets.begin(), hot_load.hot_buckets.end(),
+          [&](auto const &b) {
+            return map.owner_of_bucket(b.first) == hot && b.second > 0 &&
+                   b.second <= gap / 2;
+          });
+      if (candidate == hot_load.hot_buckets.end()) {
+        break;
+      }
+      plans.push_back({candidate->first, cold});
+      hot_load.qps -= candidate->second;
+      cold_load.qps += candidate->second;
+      hot_load.hot_buckets.erase(candidate);
+      budget -= 1;
+    }
+    return plans;
+  }
+
+private:
+  void refill(Clock::time_point now) {
+    auto limit = static_cast<double>(options.max_moves_per_minute);
+    std::chrono::duration<double> elapsed = now - refilled_at;
+    refilled_at = now;
+    budget = std::min(limit, budget + limit * elapsed.count() / 60);
+  }
+
+  Options options;
+  std::map<int, Load> loads;
+  double budget;
+  Clock::time_point refilled_at = Clock::now();
+};
@@ -0,0 +1,127 @@
+#include <array>
+#include <utility>
+#include <vector>
+
+#include "rocksdb_profile.h"
+
+#include "rocksdb/cache.h"
+#include "rocksdb/env.h"
+#include "rocksdb/filter_policy.h"
+#include "rocksdb/slice_transform.h"
+#include "rocksdb/table.h"
+#include "rocksdb/utilities/options_util.h"
+
+namespace
+{
+	constexpr size_t MiB = 1024 * 1024;
+
+	void no_compression(rocksdb::Options *options)
+	{
+		options->compression = rocksdb::kNoCompression;
+		options->compression_per_level.assign(options->num_levels, rocksdb::kNoCompression);
+	}
+
+	void default_profile(rocksdb::Options *options)
+	{
+		options->IncreaseParallelism();
+		options->OptimizeLevelStyleCompaction();
+	}
+
+	void point_lookup_profile(rocksdb::Options *options)
+	{
+		options->IncreaseParallelism();
+		options->OptimizeLevelStyleCompaction();
+		options->OptimizeForPointLookup(256);
+
+		// full filters instead of the block-based ones OptimizeForPointLookup() sets
+		rocksdb::BlockBasedTableOptions table_options;
+		table_options.index_type = rocksdb::BlockBasedTableOptions::kHashSearch;
+		table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, false));
+		table_options.whole_key_filtering = true;
+		table_options.block_cache = rocksdb::NewLRUCache(256 * MiB);
+		options->table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+	}
+
+	void write_heavy_profile(rocksdb::Options *options)
+	{
+		options->IncreaseParallelism();
+		options->OptimizeUniversalStyleCompaction(1024 * MiB);
+		options->max_background_flushes = 2;
+	}
+
+	void memory_constrained_profile(rocksdb::Options *options)
+	{
+		options->OptimizeForSmallDb();
+		options->max_write_buffer_number = 2;
+		options->max_open_files = 256;
+
+		rocksdb::BlockBasedTableOptions table_options;
+		table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, false));
+		table_options.block_cache = rocksdb::NewLRUCache(16 * MiB);
+		// charged to the block cache instead of growing with the DB
+		table_options.cache_index_and_filter_blocks = true;
+		table_options.pin_l0_filter_and_index_blocks_in_cache = true;
+		options->table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+	}
+
+	using profile = std::pair<std::string_view, void (*)(rocksdb::Options *)>;
+
+	constexpr std::array<profile, 4> profiles{{
+		{"default", default_profile},
+		{"point-lookup", point_lookup_profile},
+		{"write-heavy", write_heavy_profile},
+		{"memory-constrained", memory_constrained_profile},
+	}};
+} // namespace
+
+auto apply_rocksdb_profile(std::string_view name, rocksdb::Options *options) -> bool
+{
+	for (auto const &[profile_name, apply] : profiles)
+	{
+		if (profile_name != name)
+			continue;
+		apply(options);
+		no_compression(options);
+		return true;
+	}
+	return false;
+}
+
+auto rocksdb_profile_names() -> std::string
+{
+	std::string names;
+	for (auto const &[profile_name, apply] : profiles)
+	{
+		if (!names.empty())
+			names += ", ";
+		names += profile_name;
+	}
+	return names;
+}
+
+auto load_rocksdb_options(std::string const &path, rocksdb::Options *options) -> rocksdb::Status
+{
+	rocksdb::DBOptions db_options;
+	std::vector<rocksdb::ColumnFamilyDescriptor> cf_descs;
+	rocksdb::Status rock_s = rocksdb::LoadOptionsFromFile(path, rocksdb::Env::Default(), &db_options, &cf_descs);
+	if (!rock_s.ok())
+		return rock_s;
+
+	for (auto const &cf_desc : cf_descs)
+	{
+		if (cf_desc.name != rocksdb::kDefaultColumnFamilyName)
+			continue;
+		*options = rocksdb::Options(db_options, cf_desc.options);
+
+		// the file names the prefix extractor only, like the point-lookup
+		// profile's whole-key one that a hash index cannot do without
+		auto *table_factory = options->table_factory.get();
+		if (options->prefix_extractor == nullptr && table_factory != nullptr &&
+			std::string_view(table_factory->Name()) == "BlockBasedTable" &&
+			static_cast<rocksdb::BlockBasedTableOptions *>(table_factory->GetOptions())->index_type ==
+				rocksdb::BlockBasedTableOptions::kHashSearch)
+			options->prefix_extractor.reset(rocksdb::NewNoopTransform());
+		return rock_s;
+	}
+	return rocksdb::Status::InvalidArgument(path, "has no default column family");
+}
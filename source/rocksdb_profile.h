@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include "rocksdb/options.h"
+#include "rocksdb/status.h"
+
+/**
+ ** Named RocksDB tunings for svr, applied on top of rocksdb::Options():
+ **  - default:            what svr always used, level compaction with a
+ **                        512 MiB memtable budget and the default block cache
+ **  - point-lookup:       OptimizeForPointLookup() with a full-key bloom
+ **                        filter (10 bits per key), a hash index and a
+ **                        256 MiB LRU block cache; GETs that miss a file
+ **                        skip it without reading a block
+ **  - write-heavy:        universal compaction and big memtables, so each
+ **                        byte is rewritten fewer times
+ **  - memory-constrained: OptimizeForSmallDb() with a 16 MiB block cache
+ **                        that also holds the index and filter blocks, and
+ **                        few open files
+ ** None of them compresses.
+ **/
+auto apply_rocksdb_profile(std::string_view name, rocksdb::Options *options)
+    -> bool;
+
+// the names apply_rocksdb_profile() knows, for the help and error messages
+auto rocksdb_profile_names() -> std::string;
+
+/**
+ ** The DB options and the default column family options of a RocksDB
+ ** OPTIONS file, e.g. one written into a sub_DB_* directory. Options given
+ ** by name only, like the comparator, keep their defaults.
+ **/
+auto load_rocksdb_options(std::string const &path, rocksdb::Options *options)
+    -> rocksdb::Status;
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <message.h>
+
+#include "bucket_map.h"
+
+/**
+ ** Which shard serves which key. The master owns the table and bumps its
+ ** epoch on every change of the BucketMap; a client fetches a copy once
+ ** with a ROUTE op and routes every key locally from then on, so neither
+ ** the keys nor the values of its requests go through the master.
+ **
+ ** Epochs only compare within a cluster, which the master names with a
+ ** random id when it starts; a copy from another cluster is replaced whole.
+ ** The master remembers the bucket moves of its last max_history epochs. A
+ ** client that asks with the epoch of its copy gets only the moves since
+ ** then, if they are still known and fewer than a quarter of the buckets,
+ ** instead of the whole table.
+ **/
+class RoutingTable {
+public:
+  static constexpr size_t max_history = 16;
+
+  RoutingTable() = default;
+  explicit RoutingTable(uint64_t cluster) : cluster_id(cluster) {}
+
+  [[nodiscard]] auto cluster() const -> uint64_t { return cluster_id; }
+  [[nodiscard]] auto epoch() const -> uint64_t { return current_epoch; }
+  [[nodiscard]] auto ports() const -> std::vector<int> const & {
+    return shard_ports;
+  }
+  [[nodiscard]] auto buckets() const -> BucketMap const & { return map; }
+
+  // the port of the shard that serves key, nullopt without shards
+  [[nodiscard]] auto shard_of(int key) const -> std::optional<int> {
+    return map.owner(key);
+  }
+
+  // returns the buckets the shard took over
+  auto add(int port) -> std::vector<BucketMap::Move> {
+    shard_ports.push_back(port);
+    return changed(map.add(port));
+  }
+
+  // returns the buckets the other shards took over, none if no shard
+  // listens on port
+  auto remove(int port) -> std::vector<BucketMap::Move> {
+    auto it = std::find(shard_ports.begin(), shard_ports.end(), port);
+    if (it == shard_ports.end()) {
+      return {};
+    }
+    shard_ports.erase(it);
+    return changed(map.remove(port));
+  }
+
+  // moves buckets between the shards of the table, in one epoch
+  auto assign(std::vector<std::pair<uint32_t, int>> const &buckets)
+      -> std::vector<BucketMap::Move> {
+    std::vector<BucketMap::Move> moves;
+    moves.reserve(buckets.size());
+    for (auto const &[bucket, port] : buckets) {
+      moves.push_back(map.assign(bucket, port));
+    }
+    return changed(std::move(moves));
+  }
+
+  // the moves since known_epoch of this cluster if they are still
+  // remembered, else the whole table
+  void to_message(sockets::client_msg::RoutingTable *message,
+                  std::optional<uint64_t> known_epoch = std::nullopt) const {
+    message->set_cluster(cluster_id);
+    message->set_epoch(current_epoch);
+    message->mutable_ports()->Assign(shard_ports.begin(), shard_ports.end());
+    if (known_epoch && *known_epoch <= current_epoch &&
+        current_epoch - *known_epoch <= history.size()) {
+      auto first = history.size() - (current_epoch - *known_epoch);
+      size_t no_moves = 0;
+      for (auto i = first; i < history.size(); i++) {
+        no_moves += history[i].size();
+      }
+      if (no_moves < BucketMap::no_buckets / 4) {
+        message->set_base_epoch(*known_epoch);
+        for (auto i = first; i < history.size(); i++) {
+          for (auto const &move : history[i]) {
+            message->add_moved(move.bucket);
+            message->add_moved_to(index_of(move.to));
+          }
+        }
+        return;
+      }
+    }
+    // a byte per bucket below 128 shards
+    for (uint32_t bucket = 0; bucket < BucketMap::no_buckets; bucket++) {
+      message->add_owners(index_of(map.owner_of_bucket(bucket)));
+    }
+  }
+
+  // takes over a table or the moves since this copy's epoch; returns false
+  // if the moves are for another epoch or the message is malformed
+  auto update(sockets::client_msg::RoutingTable const &message) -> bool {
+    auto port_at = [&message](uint32_t index) -> std::optional<int> {
+      auto no_ports = static_cast<uint32_t>(message.ports_size());
+      if (index > no_ports) {
+        return std::nullopt;
+      }
+      return index == no_ports ? 0 : message.ports(static_cast<int>(index));
+    };
+    if (message.has_base_epoch()) {
+      if (message.cluster() != cluster_id ||
+          message.base_epoch() != current_epoch ||
+          message.moved_size() != message.moved_to_size()) {
+        return false;
+      }
+      for (int i = 0; i < message.moved_size(); i++) {
+        auto port = port_at(message.moved_to(i));
+        if (message.moved(i) >= BucketMap::no_buckets || !port) {
+          return false;
+        }
+        map.assign(message.moved(i), *port);
+      }
+    } else {
+      if (message.owners_size() != static_cast<int>(BucketMap::no_buckets)) {
+        return false;
+      }
+      std::vector<int> owners;
+      owners.reserve(BucketMap::no_buckets);
+      for (auto index : message.owners()) {
+        auto port = port_at(index);
+        if (!port) {
+          return false;
+        }
+        owners.push_back(*port);
+      }
+      map.assign_all(owners);
+    }
+    shard_ports.assign(message.ports().begin(), message.ports().end());
+    cluster_id = message.cluster();
+    current_epoch = message.epoch();
+    history.clear();
+    return true;
+  }
+
+private:
+  // in shard_ports, its size for none
+  [[nodiscard]] auto index_of(int port) const -> uint32_t {
+    return static_cast<uint32_t>(
+        std::find(shard_ports.begin(), shard_ports.end(), port) -
+        shard_ports.begin());
+  }
+
+  auto changed(std::vector<BucketMap::Move> moves)
+      -> std::vector<BucketMap::Move> {
+    current_epoch++;
+    history.push_back(moves);
+    if (history.size() > max_history) {
+      history.pop_front();
+    }
+    return moves;
+  }
+
+  uint64_t cluster_id = 0;
+  uint64_t current_epoch = 0;
+  // in the order they joined
+  std::vector<int> shard_ports;
+  BucketMap map;
+  // the moves of the last epochs, the newest at the back
+  std::deque<std::vector<BucketMap::Move>> history;
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "flat_table.h"
+
+/**
+ ** S3-FIFO eviction order for one FlatTable. A new key enters the small
+ ** FIFO. If it is read again while there, it moves on to the main FIFO;
+ ** otherwise it is evicted after one pass and its key is remembered as a
+ ** ghost. A ghost that comes back goes straight to main. Main works
+ ** like CLOCK: a key at its tail that was read since its last pass goes
+ ** round again with one read less. A scan reads each key once, so it only
+ ** washes through the small FIFO and leaves the hot keys in main alone.
+ ** The owner's lock guards all of it.
+ **
+ ** A key that is erased stays queued until eviction gets to it. Every
+ ** insertion stamps the table's value, so the entry of an erased or since
+ ** inserted again key is told apart and dropped; the queued entries count
+ ** towards the budget until then.
+ **/
+class S3Fifo {
+public:
+  // after the table got a key that it did not hold
+  void inserted(FlatTable &table, int key) {
+    auto stamp = ++no_inserted;
+    table.set_stamp(key, stamp);
+    auto &ghost = ghosts[ghost_slot(key)];
+    if (ghost == key) {
+      ghost = no_ghost;
+      main.push_back({key, stamp});
+    } else {
+      small.push_back({key, stamp});
+    }
+    auto cached = small.size() + main.size();
+    if (cached > ghosts.size()) {
+      // as many ghosts as cached keys; the old ones are forgotten
+      ghosts.assign(std::bit_ceil(cached), no_ghost);
+    }
+  }
+
+  // queued entries and ghosts, in bytes
+  [[nodiscard]] auto memory_usage() const -> size_t {
+    return (small.size() + main.size()) * sizeof(Queued) +
+           ghosts.size() * sizeof(int);
+  }
+
+  // evicts keys until the table takes at most budget bytes, returns how
+  // many
+  auto evict(FlatTable &table, size_t budget) -> size_t {
+    size_t evicted = 0;
+    // a write pays for a bounded number of steps; every step lowers a read
+    // count or evicts
+    for (size_t step = 0;
+         step < max_steps && table.memory_usage() + memory_usage() > budget;
+         step++) {
+      auto from_small =
+          !small.empty() && (main.empty() || small.size() * small_share_den >=
+                                                 small.size() + main.size());
+      auto &fifo = from_small ? small : main;
+      if (fifo.empty()) {
+        break;
+      }
+      auto queued = fifo.front();
+      fifo.pop_front();
+      auto entry = table.entry(queued.key);
+      if (!entry || entry->stamp != queued.stamp) {
+        continue; // erased since, or queued again
+      }
+      if (entry->freq > 0) {
+        // out of small after one read, round main once per read
+        table.set_freq(queued.key, from_small ? 0 : entry->freq - 1);
+        main.push_back(queued);
+      } else {
+        table.erase(queued.key);
+        if (from_small) {
+          ghosts[ghost_slot(queued.key)] = queued.key;
+        }
+        evicted++;
+      }
+    }
+    return evicted;
+  }
+
+private:
+  // the small FIFO holds a tenth of the keys
+  static constexpr size_t small_share_den = 10;
+  static constexpr size_t max_steps = 64;
+
+  [[nodiscard]] auto ghost_slot(int key) const -> size_t {
+    return (static_cast<uint32_t>(key) * 2654435761U) & (ghosts.size() - 1);
+  }
+
+  // not a key, see KvStore::get_next_key()
+  static constexpr int no_ghost = -1;
+
+  struct Queued {
+    int key;
+    uint32_t stamp; // of the insertion that queued it
+  };
+
+  std::deque<Queued> small;
+  std::deque<Queued> main;
+  uint32_t no_inserted = 0;
+  // direct-mapped like the admission slots of the server, one key each
+  std::vector<int> ghosts = std::vector<int>(16, no_ghost);
+};
@@ -12,15 +12,37 @@
 #include <iostream>
 #include <sys/select.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <thread>
 #include <pthread.h>
+#include <csignal>
 #include <mutex>
+#include <map>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "event_loop.h"
+#if defined(SVR_IO_URING)
+#include "uring_loop.h"
+#endif
+#include "key_codec.h"
 #include "kv_store.h"
 #include "message.h"
 #include "shared.h"
 #include "workload_traces/generate_traces.h"
+#include "write_back.h"
+#include "group_commit.h"
+#include "rocksdb_profile.h"
+#include "routing_table.h"
+#include "slab_allocator.h"
 
 #include <cxxopts.hpp>
 #include <fmt/printf.h>
@@ -30,14 +52,22 @@
 #include "rocksdb/db.h"
 #include "rocksdb/slice.h"
 #include "rocksdb/options.h"
-
-std::mutex m;
-struct timeval timeout;
+#include "rocksdb/statistics.h"
+#include "rocksdb/write_batch.h"
 
 // int no_threads, server_port, no_clients ;
-int server_port, master_port;
+int server_port, master_port, no_threads;
 std::string server_address;
-std::vector<int> connections; // std::tuple<int, int>> socket_fds;
+bool use_io_uring = false;
+// set for group and async durability only
+std::unique_ptr<WriteBack> write_back;
+// set for sync durability only
+std::unique_ptr<GroupCommit> group_commit;
+std::shared_ptr<rocksdb::Statistics> rock_stats;
+static constexpr size_t max_dirty_bytes = 4 * 1024 * 1024;
+static constexpr unsigned stats_interval = 10; // seconds
+// reported to the master on every heartbeat
+static constexpr size_t hot_buckets_reported = 16;
 
 class ServerThread
 {
@@ -51,180 +81,1183 @@ public:
 
 std::atomic<int> threads_ids{0};
 
+/**
+ ** The owner of every bucket after the routing table the master sent last.
+ ** The workers check each GET and PUT against it without a lock. Until the
+ ** first table arrives every owner is 0 and the server takes every key. An
+ ** owner is published with release, so a worker that sees it also sees the
+ ** BucketHandoffs state that came with its table.
+ **/
+class ShardOwnership
+{
+	std::mutex mtx; // lock for the writers
+	uint64_t cluster = 0;
+	std::atomic<uint64_t> current_epoch{0};
+	std::array<std::atomic<int>, BucketMap::no_buckets> owners{};
+
+public:
+	// takes over a table newer than the current one or from another
+	// cluster, returns false for an older one that arrived late
+	bool update(RoutingTable const &table)
+	{
+		std::lock_guard<std::mutex> l(mtx);
+		if (table.cluster() == cluster && table.epoch() <= current_epoch.load(std::memory_order_relaxed))
+			return false;
+		for (uint32_t bucket = 0; bucket < BucketMap::no_buckets; bucket++)
+			owners[bucket].store(table.buckets().owner_of_bucket(bucket), std::memory_order_release);
+		cluster = table.cluster();
+		current_epoch.store(table.epoch(), std::memory_order_relaxed);
+		return true;
+	}
+
+	// the port of the shard that owns bucket, if that is not this one
+	std::optional<int> bucket_owner_elsewhere(uint32_t bucket) const
+	{
+		int owner = owners[bucket].load(std::memory_order_acquire);
+		if (owner == 0 || owner == server_port)
+			return std::nullopt;
+		return owner;
+	}
+
+	std::optional<int> owner_elsewhere(int key) const { return bucket_owner_elsewhere(BucketMap::bucket_of(key)); }
+
+	uint64_t epoch() const { return current_epoch.load(std::memory_order_relaxed); }
+};
+
+ShardOwnership ownership;
+
+/**
+ ** The buckets whose keys move between shards after a change of the routing
+ ** table, see send_all(). The old owner still answers the GETs of a bucket
+ ** it hands over, until all of its keys are on the new owner; the new owner
+ ** sends a GET it misses meanwhile to the old one. A PUT on the new owner
+ ** claims its key, so that the older value handed over does not replace it.
+ **
+ ** The keys of a HANDOFF are written like PUTs, see take_over(). With sync
+ ** durability they are staged for the group commit of the worker's round,
+ ** which also holds back the reply; until then they are in flight, and a
+ ** PUT of another worker on such a key waits for that commit, so that its
+ ** newer value lands after the old one.
+ **/
+class BucketHandoffs
+{
+	std::mutex mtx; // lock for the writers, the claims and the keys in flight
+	std::condition_variable landed; // keys in flight were committed
+	// the shard that hands the bucket over to this one, 0 for none
+	std::array<std::atomic<int>, BucketMap::no_buckets> incoming{};
+	std::array<std::atomic<bool>, BucketMap::no_buckets> outgoing{};
+	// the epoch of the last move of the bucket that was handed over here, for
+	// a HANDOFF that arrives before the table that announces it
+	std::array<uint64_t, BucketMap::no_buckets> handed_over_epoch{};
+	std::unordered_set<int> claimed; // PUT here while their bucket is incoming
+	// keys of HANDOFFs staged for a group commit, by the worker that staged
+	std::unordered_map<int, std::thread::id> in_flight;
+
+	// what the calling worker staged for its next commit
+	struct Staged
+	{
+		std::vector<int> keys;
+		uint64_t epoch = 0;
+		int from = 0;
+		std::vector<uint32_t> buckets; // complete once the keys are committed
+	};
+	static auto staged() -> Staged &
+	{
+		thread_local Staged staged;
+		return staged;
+	}
+
+public:
+	// the moves that come with a table of the master, before it is taken over
+	void expect(sockets::client_msg const &message)
+	{
+		auto epoch = message.routing().epoch();
+		std::lock_guard<std::mutex> l(mtx);
+		for (int i = 0; i < std::min(message.incoming_buckets_size(), message.incoming_from_size()); i++)
+		{
+			auto bucket = message.incoming_buckets(i);
+			if (bucket < BucketMap::no_buckets && handed_over_epoch[bucket] < epoch)
+				incoming[bucket].store(message.incoming_from(i), std::memory_order_release);
+		}
+		if (message.ops_size() > 0 && message.ops(0).type() == sockets::client_msg_OperationType_TXN_START)
+			for (auto bucket : message.moved_buckets())
+				if (bucket < BucketMap::no_buckets)
+					outgoing[bucket].store(true, std::memory_order_release);
+	}
+
+	// once a table is taken over: a shard that left it hands nothing over
+	void forget_left(std::vector<int> const &ports)
+	{
+		std::lock_guard<std::mutex> l(mtx);
+		for (auto &from : incoming)
+		{
+			auto port = from.load(std::memory_order_relaxed);
+			if (port != 0 && std::find(ports.begin(), ports.end(), port) == ports.end())
+				from.store(0, std::memory_order_relaxed);
+		}
+		forget_claims();
+	}
+
+	// the shard that still hands over the bucket of key
+	std::optional<int> incoming_from(int key) const
+	{
+		int from = incoming[BucketMap::bucket_of(key)].load(std::memory_order_acquire);
+		if (from == 0)
+			return std::nullopt;
+		return from;
+	}
+
+	bool is_outgoing(int key) const { return outgoing[BucketMap::bucket_of(key)].load(std::memory_order_acquire); }
+
+	// before a PUT of key is applied
+	void claim(int key)
+	{
+		if (!incoming_from(key))
+			return;
+		std::unique_lock<std::mutex> l(mtx);
+		claimed.insert(key);
+		landed.wait(l, [this, key]
+					{
+			auto it = in_flight.find(key);
+			return it == in_flight.end() || it->second == std::this_thread::get_id(); });
+	}
+
+	/**
+	 ** Writes the keys of a HANDOFF that no PUT claimed like PUTs: staged
+	 ** for the worker's group commit, or into the write-back, and out of the
+	 ** cache, which may still hold them from an earlier stay of their
+	 ** bucket. Once the last batch of a bucket is in, its GETs are answered
+	 ** here alone; with a group commit only after committed().
+	 **/
+	void take_over(KvStore &kv, sockets::client_msg const &message)
+	{
+		std::lock_guard<std::mutex> l(mtx);
+		auto &mine = staged();
+		for (auto const &op : message.ops())
+		{
+			if (!op.has_key() || claimed.count(op.key()) > 0)
+				continue;
+			kv.erase(op.key());
+			if (write_back)
+			{
+				write_back->put(op.key(), op.value());
+				continue;
+			}
+			GroupCommit::stage(op.key(), op.value()); // cached once committed
+			in_flight.insert_or_assign(op.key(), std::this_thread::get_id());
+			mine.keys.push_back(op.key());
+		}
+		if (write_back)
+		{
+			done_with(message.handoff_from(), message.handoff_epoch(), message.handed_over());
+			return;
+		}
+		mine.from = message.handoff_from();
+		mine.epoch = message.handoff_epoch();
+		mine.buckets.insert(mine.buckets.end(), message.handed_over().begin(), message.handed_over().end());
+	}
+
+	// after the group commit of the calling worker, see take_over()
+	void committed(bool ok)
+	{
+		auto &mine = staged();
+		if (mine.keys.empty() && mine.buckets.empty())
+			return;
+		{
+			std::lock_guard<std::mutex> l(mtx);
+			for (auto key : mine.keys)
+				in_flight.erase(key);
+			// without the keys the old owner keeps the buckets, its HANDOFF
+			// got no reply
+			if (ok)
+				done_with(mine.from, mine.epoch, mine.buckets);
+		}
+		landed.notify_all();
+		mine = Staged{};
+	}
+
+	// on the old owner, once the new one has all keys of the buckets
+	void handed_over(std::vector<uint32_t> const &buckets)
+	{
+		for (auto bucket : buckets)
+			outgoing[bucket].store(false, std::memory_order_release);
+	}
+
+private:
+	// the caller holds mtx; the buckets from is done with
+	template <typename Buckets>
+	void done_with(int from, uint64_t epoch, Buckets const &buckets)
+	{
+		for (auto bucket : buckets)
+		{
+			if (bucket >= BucketMap::no_buckets)
+				continue;
+			if (incoming[bucket].load(std::memory_order_relaxed) == from)
+				incoming[bucket].store(0, std::memory_order_release);
+			handed_over_epoch[bucket] = std::max(handed_over_epoch[bucket], epoch);
+		}
+		forget_claims();
+	}
+
+	// the caller holds mtx
+	void forget_claims()
+	{
+		std::erase_if(claimed, [this](int key)
+					  { return incoming[BucketMap::bucket_of(key)].load(std::memory_order_relaxed) == 0; });
+	}
+};
+
+BucketHandoffs handoffs;
+
+/**
+ ** The loop rounds of the workers, for a change of ownership to wait out
+ ** the PUTs that were taken before it: a PUT is only staged or in the
+ ** write-back during a round and in RocksDB or the write-back once the
+ ** round is committed. A worker's count is odd from the first frame of a
+ ** round to its commit. A round that starts after the change sees the new
+ ** owners, so settle() only waits for the ones that were odd.
+ **/
+class WorkerRounds
+{
+	struct alignas(64) Worker
+	{
+		std::atomic<uint64_t> count{0};
+	};
+
+	std::mutex mtx; // lock for workers
+	std::deque<Worker> workers;
+
+	static auto self() -> Worker *&
+	{
+		thread_local Worker *worker = nullptr;
+		return worker;
+	}
+
+public:
+	// by every worker, before its loop runs
+	void join()
+	{
+		std::lock_guard<std::mutex> l(mtx);
+		self() = &workers.emplace_back();
+	}
+
+	// before a frame is handled; pairs with the fence in settle()
+	void begin()
+	{
+		auto *worker = self();
+		if (worker == nullptr || worker->count.load(std::memory_order_relaxed) % 2 == 1)
+			return;
+		worker->count.store(worker->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	// once the round is committed
+	void end()
+	{
+		auto *worker = self();
+		if (worker == nullptr || worker->count.load(std::memory_order_relaxed) % 2 == 0)
+			return;
+		worker->count.store(worker->count.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// after the change of ownership, waits for the rounds that were running
+	void settle()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::vector<std::pair<Worker *, uint64_t>> running;
+		{
+			std::lock_guard<std::mutex> l(mtx);
+			for (auto &worker : workers)
+				if (auto count = worker.count.load(std::memory_order_relaxed); count % 2 == 1)
+					running.emplace_back(&worker, count);
+		}
+		for (auto [worker, count] : running)
+			while (worker->count.load(std::memory_order_acquire) == count)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+};
+
+WorkerRounds worker_rounds;
+
+// a table of the master with the moves that come with it
+void update_ownership(sockets::client_msg const &message)
+{
+	RoutingTable table;
+	if (!table.update(message.routing()))
+	{
+		fmt::print("Malformed routing table\n");
+		return;
+	}
+	handoffs.expect(message);
+	if (!ownership.update(table))
+		return;
+	handoffs.forget_left(table.ports());
+	fmt::print("Routing table of epoch {}, {} buckets owned\n", table.epoch(), table.buckets().buckets_of(server_port));
+}
+
+/**
+ ** The GETs and PUTs per bucket and the time the server takes for a
+ ** request, for the heartbeats to the master. Counted with relaxed atomics
+ ** like the cache counters; every heartbeat takes the counts and starts
+ ** them over.
+ **/
+class LoadTracker
+{
+	std::array<std::atomic<uint32_t>, BucketMap::no_buckets> bucket_ops{};
+	// requests by the bit width of their microseconds
+	std::array<std::atomic<uint64_t>, 33> latencies{};
+
+public:
+	void count(int key) { bucket_ops[BucketMap::bucket_of(key)].fetch_add(1, std::memory_order_relaxed); }
+
+	void took(std::chrono::steady_clock::duration duration)
+	{
+		auto micros = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+		auto bin = std::bit_width(static_cast<uint32_t>(std::clamp<int64_t>(micros, 0, UINT32_MAX)));
+		latencies[bin].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// the load of the last seconds; the 99th percentile is rounded up to a
+	// power of two
+	void collect(double seconds, sockets::client_msg::ShardLoad *load)
+	{
+		uint64_t no_ops = 0;
+		std::vector<std::pair<uint32_t, uint32_t>> busy; // ops, bucket
+		for (uint32_t bucket = 0; bucket < BucketMap::no_buckets; bucket++)
+		{
+			auto ops = bucket_ops[bucket].exchange(0, std::memory_order_relaxed);
+			no_ops += ops;
+			if (ops > 0)
+				busy.emplace_back(ops, bucket);
+		}
+		auto no_hot = std::min(busy.size(), hot_buckets_reported);
+		std::partial_sort(busy.begin(), busy.begin() + no_hot, busy.end(), std::greater<>());
+		load->set_qps(no_ops / seconds);
+		for (size_t i = 0; i < no_hot; i++)
+		{
+			load->add_hot_buckets(busy[i].second);
+			load->add_hot_qps(busy[i].first / seconds);
+		}
+
+		std::array<uint64_t, 33> counts{};
+		uint64_t no_requests = 0;
+		for (size_t bin = 0; bin < counts.size(); bin++)
+		{
+			counts[bin] = latencies[bin].exchange(0, std::memory_order_relaxed);
+			no_requests += counts[bin];
+		}
+		uint64_t below = 0;
+		for (size_t bin = 0; bin < counts.size() && no_requests > 0; bin++)
+		{
+			below += counts[bin];
+			if (below * 100 >= no_requests * 99)
+			{
+				load->set_p99_us(static_cast<uint32_t>(std::min<uint64_t>((uint64_t{1} << bin) - 1, UINT32_MAX)));
+				break;
+			}
+		}
+	}
+};
+
+LoadTracker load_tracker;
+
+// WRONG_SHARD: fills in rep for a key of another shard and returns true; a
+// GET of a bucket this shard still hands over is served here
+bool wrong_shard(int key, server::server_response::reply *rep, bool reading = false)
+{
+	auto owner = ownership.owner_elsewhere(key);
+	if (!owner || (reading && handoffs.is_outgoing(key)))
+		return false;
+	rep->set_success(false);
+	rep->set_owner(*owner);
+	rep->set_epoch(ownership.epoch());
+	fmt::print("WRONG_SHARD < {} - {} >\n", key, *owner);
+	return true;
+}
+
+/**
+ ** WRONG_SHARD for a GET that missed a key of a bucket between two shards:
+ ** on the new owner the key may still be on its way, on the old one it may
+ ** just have been handed over. Fills in rep with the shard to ask instead
+ ** and returns true.
+ **/
+bool moving_elsewhere(int key, server::server_response::reply *rep)
+{
+	auto other = handoffs.incoming_from(key);
+	if (!other && !handoffs.is_outgoing(key))
+		other = ownership.owner_elsewhere(key);
+	if (!other)
+		return false;
+	rep->set_success(false);
+	rep->set_owner(*other);
+	rep->set_epoch(ownership.epoch());
+	fmt::print("MOVING < {} - {} >\n", key, *other);
+	return true;
+}
+
 class ServerOP
 {
-	std::shared_ptr<KvStore> local_kv;
+	// shared by all worker threads; TXN_START swaps in a fresh store while
+	// the other event loops keep serving requests
+	std::atomic<std::shared_ptr<KvStore>> local_kv;
+	size_t cache_bytes; // limit of every store, 0 for none
+
+	// admission: a key read from RocksDB is cached on its second miss within
+	// a slot's lifetime, so a one-off scan does not flush the hot keys
+	static constexpr size_t admission_slots = 4096;
+	static constexpr size_t max_admitted_size = 64 * 1024;
+	std::array<std::atomic<int>, admission_slots> missed_keys{};
 
 public:
-	ServerOP()
+	// counters of the tiered GET path
+	std::atomic<uint64_t> cache_hits{0};
+	std::atomic<uint64_t> cache_misses{0};
+	std::atomic<uint64_t> cache_admissions{0};
+
+	explicit ServerOP(size_t cache_bytes) : cache_bytes(cache_bytes)
 	{
-		local_kv = KvStore::init();
+		local_kv = KvStore::init(cache_bytes);
 	}
 
-	void local_kv_init_it() { local_kv->init_it(); }
+	void local_kv_init_it() { local_kv.load()->init_it(); }
 
+	// with sync durability only once committed, see commit_db()
 	bool local_kv_put(int key, std::string_view value)
 	{
-		return local_kv->put(key, value);
+		return local_kv.load()->put(key, value);
 	}
 
-	std::string local_kv_get(int key)
+	// assigns into value, so a reused reply keeps its capacity
+	bool local_kv_get(int key, std::string *value)
 	{
-		std::optional<std::string_view> strvw = local_kv->get(key);
-		if (strvw == std::nullopt)
+		if (!local_kv.load()->get(key, value))
 		{
-			return std::string("NOT-FOUND");
+			cache_misses.fetch_add(1, std::memory_order_relaxed);
+			return false;
 		}
-		return std::string(strvw->data());
+		cache_hits.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// before a GET looks for key in the cache and behind it
+	uint64_t local_kv_version(int key) { return local_kv.load()->version_of(key); }
+
+	// offers a value that was read from RocksDB to the cache, unless the key
+	// was written since local_kv_version() gave version, see KvStore::admit()
+	void local_kv_admit(int key, std::string_view value, uint64_t version)
+	{
+		if (value.size() > max_admitted_size)
+			return;
+		auto slot = (static_cast<uint32_t>(key) * 2654435761U) % admission_slots;
+		if (missed_keys[slot].exchange(key, std::memory_order_relaxed) != key)
+			return;
+		if (local_kv.load()->admit(key, value, version))
+			cache_admissions.fetch_add(1, std::memory_order_relaxed);
 	}
 
 	auto local_kv_get_next_key() -> int
 	{
-		return local_kv->get_next_key();
+		return local_kv.load()->get_next_key();
 	}
 
 	auto get_local_kv()
 	{
-		return local_kv;
+		return local_kv.load();
 	}
 
 	void reset_kv()
 	{
-		local_kv = KvStore::init();
+		local_kv = KvStore::init(cache_bytes);
+	}
+
+	// atomically replaces the store and hands back the old one
+	auto take_local_kv() -> std::shared_ptr<KvStore>
+	{
+		return local_kv.exchange(KvStore::init(cache_bytes));
 	}
 };
 
-std::string get_db(rocksdb::DB &rock_db, int key)
+bool get_db(rocksdb::DB &rock_db, int key, std::string *value)
 {
-	std::string value;
-	rocksdb::Status rock_s = rock_db.Get(rocksdb::ReadOptions(), std::to_string(key), &value);
+	rocksdb::Status rock_s = rock_db.Get(rocksdb::ReadOptions(), EncodedKey(key), value);
 	if (!rock_s.ok())
 	{
-		return "NOT-FOUND";
-		// fmt::print("### {}: {}  ###\n", rock_s.ToString().c_str(), key);
+		if (!rock_s.IsNotFound())
+			fmt::print("### {}: {}  ###\n", rock_s.ToString().c_str(), key);
+		return false;
 	}
-	return value;
+	return true;
 }
 
-bool put_db(rocksdb::DB &rock_db, int key, std::string value)
+// puts the values of a commit into the KvStore once they are durable
+struct apply_puts : rocksdb::WriteBatch::Handler
 {
-	rocksdb::Status rock_s = rock_db.Put(rocksdb::WriteOptions(), std::to_string(key), value);
+	explicit apply_puts(KvStore &kv) : kv(kv) {}
+
+	void Put(rocksdb::Slice const &key, rocksdb::Slice const &value) override
+	{
+		if (auto decoded = EncodedKey::decode(key))
+			kv.put(*decoded, std::string_view(value.data(), value.size()));
+	}
+
+	KvStore &kv;
+};
+
+// PUTs staged by this worker since its last round, see server_worker(); if
+// the commit fails they are dropped with their replies
+bool commit_db(ServerOP *server_op)
+{
+	auto kv = server_op->get_local_kv();
+	apply_puts apply(*kv);
+	rocksdb::Status rock_s = group_commit->commit(&apply);
+	handoffs.committed(rock_s.ok());
 	if (!rock_s.ok())
 	{
-		fmt::print("\nPUT Errrrrrrrrrrrrrrrrrrror:\n");
+		fmt::print("\nCOMMIT Errrrrrrrrrrrrrrrrrrror:\n");
 		std::cerr << rock_s.ToString() << std::endl;
 		return false;
 	}
 	return true;
 }
 
-void send_all(int master_fd, std::shared_ptr<KvStore> temp_local_kv)
+/**
+ ** The PUTs this worker staged for its group commit first, then the KvStore;
+ ** on a miss the keys the write-back has not persisted yet, then RocksDB,
+ ** whose value is offered to the KvStore unless its bucket is being handed
+ ** over or the key was written since the GET started. The PUTs put a key
+ ** into the write-back before the KvStore, so a GET that misses the
+ ** write-back sees the KvStore's version of the key change. It returns
+ ** false if the key is nowhere.
+ **/
+bool tiered_get(ServerOP *server_op, rocksdb::DB &rock_db, Connection &conn, int key, std::string *value)
 {
-	fmt::print("\n---redistribution---\n");
-
-	while (auto kv = temp_local_kv->get_next_key())
+	if (group_commit)
 	{
-		auto value = temp_local_kv->get(kv)->data();
-		// usleep(5 * 1000);
-		if (kv == -1)
+		if (auto staged = GroupCommit::staged_value(key))
 		{
-			break;
+			value->assign(*staged);
+			conn.await_commit();
+			return true;
 		}
+	}
+	auto version = server_op->local_kv_version(key);
+	if (server_op->local_kv_get(key, value))
+		return true;
+	if (write_back && write_back->get(key, value))
+		return true;
+	if (!get_db(rock_db, key, value))
+		return false;
+	if (!handoffs.is_outgoing(key))
+		server_op->local_kv_admit(key, *value, version);
+	return true;
+}
+
+// write amplification: bytes RocksDB wrote to SST files per byte written to it
+void report_rocksdb_stats()
+{
+	auto written = rock_stats->getTickerCount(rocksdb::BYTES_WRITTEN);
+	auto flushed = rock_stats->getTickerCount(rocksdb::FLUSH_WRITE_BYTES);
+	auto compacted = rock_stats->getTickerCount(rocksdb::COMPACT_WRITE_BYTES);
+	auto block_hits = rock_stats->getTickerCount(rocksdb::BLOCK_CACHE_HIT);
+	auto block_misses = rock_stats->getTickerCount(rocksdb::BLOCK_CACHE_MISS);
+	fmt::print("ROCKSDB < written {}, flushed {}, compacted {}, write amp {:.2f}, block cache hit ratio {:.3f}, "
+			   "bloom filter skips {} >\n",
+			   written, flushed, compacted, written > 0 ? static_cast<double>(flushed + compacted) / written : 0.0,
+			   block_hits + block_misses > 0 ? static_cast<double>(block_hits) / (block_hits + block_misses) : 0.0,
+			   rock_stats->getTickerCount(rocksdb::BLOOM_FILTER_USEFUL));
+}
+
+// whether RocksDB has no flush or compaction pending or running
+bool rocksdb_idle(rocksdb::DB &rock_db)
+{
+	for (auto const *property :
+		 {&rocksdb::DB::Properties::kMemTableFlushPending, &rocksdb::DB::Properties::kNumRunningFlushes,
+		  &rocksdb::DB::Properties::kCompactionPending, &rocksdb::DB::Properties::kNumRunningCompactions})
+	{
+		uint64_t value = 0;
+		if (rock_db.GetIntProperty(*property, &value) && value > 0)
+			return false;
+	}
+	return true;
+}
 
-		std::string cmd = "./build/dev/clt -p 0 -d 0 -m 1025 -o PUT -k ";
-		cmd += std::to_string(kv);
-		cmd += " -v ";
-		cmd += value;
-		cmd += " & ";
-		// fmt::print("%s\n", cmd.c_str());
-		if (system(cmd.c_str()) == -1)
-			fmt::print("system error!\n");
+/**
+ ** On SIGUSR1 the write-back and the memtables are flushed, and once the
+ ** compactions that sets off are done the ROCKSDB line is printed, followed
+ ** by SETTLED: its write amplification then covers every byte written so far.
+ **/
+void settle_on_signal(rocksdb::DB *rock_db, sigset_t signals)
+{
+	int signal = 0;
+	while (sigwait(&signals, &signal) == 0)
+	{
+		if (write_back)
+			write_back->flush();
+		rocksdb::Status rock_s = rock_db->Flush(rocksdb::FlushOptions());
+		if (!rock_s.ok())
+			fmt::print("### Flush: {} ###\n", rock_s.ToString());
+		while (!rocksdb_idle(*rock_db))
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		report_rocksdb_stats();
+		fmt::print("SETTLED\n");
+		std::fflush(stdout);
 	}
-	fmt::printf("end of redistribution\n");
 }
 
-void server_worker(ServerOP *server_op, rocksdb::DB &rock_db)
+// internal: rounding up to the size classes; free: reserved but not in use
+void report_slab_stats(SlabAllocator::Stats const &slab)
+{
+	constexpr double mib = 1024.0 * 1024.0;
+	fmt::print("SLAB < reserved {:.1f} MiB, allocated {:.1f} MiB, requested {:.1f} MiB, internal fragmentation {:.3f}, "
+			   "free {:.3f} >\n",
+			   slab.reserved / mib, slab.allocated / mib, slab.requested / mib,
+			   slab.allocated > 0 ? 1.0 - static_cast<double>(slab.requested) / slab.allocated : 0.0,
+			   slab.reserved > 0 ? 1.0 - static_cast<double>(slab.allocated) / slab.reserved : 0.0);
+}
+
+void report_stats(ServerOP *server_op)
 {
+	uint64_t last_gets = 0;
+	uint64_t last_evictions = 0;
+	size_t last_slab_allocated = 0;
+	uint64_t last_rocksdb_activity = 0;
 	while (true)
 	{
-		usleep(5 * 1000);
-		if (!connections.empty())
+		sleep(stats_interval);
+		auto hits = server_op->cache_hits.load(std::memory_order_relaxed);
+		auto misses = server_op->cache_misses.load(std::memory_order_relaxed);
+		auto kv = server_op->get_local_kv();
+		if (hits + misses != last_gets || kv->evictions() != last_evictions)
+		{
+			last_gets = hits + misses;
+			last_evictions = kv->evictions();
+			fmt::print("CACHE < hits {}, misses {}, admitted {}, evicted {}, hit ratio {:.3f}, resident {:.1f} MiB >\n", hits,
+					   misses, server_op->cache_admissions.load(std::memory_order_relaxed), last_evictions,
+					   last_gets > 0 ? static_cast<double>(hits) / last_gets : 0.0, kv->resident_bytes() / (1024.0 * 1024.0));
+		}
+		auto slab = SlabAllocator::stats();
+		if (slab.allocated != last_slab_allocated)
+		{
+			last_slab_allocated = slab.allocated;
+			report_slab_stats(slab);
+		}
+		auto rocksdb_activity = rock_stats->getTickerCount(rocksdb::NUMBER_KEYS_WRITTEN) + rock_stats->getTickerCount(rocksdb::NUMBER_KEYS_READ) +
+						   rock_stats->getTickerCount(rocksdb::COMPACT_WRITE_BYTES);
+		if (rocksdb_activity != last_rocksdb_activity)
 		{
-			// fmt::print("Pre Lock {}\n", socket_fds.size());
-			m.lock();
-			int client_fd = connections.back(); // auto [work_recv_sock, work_send_sock] = socket_fds.back();
-			connections.pop_back();
-			m.unlock();
-			// fmt::print("After Lock - got {}\n", client_fd);
+			last_rocksdb_activity = rocksdb_activity;
+			report_rocksdb_stats();
+		}
+		std::fflush(stdout);
+	}
+}
+
+/**
+ ** The keys a shard hands over to one new owner, as HANDOFF batches over
+ ** one connection. A batch waits for its reply, which the new owner sends
+ ** once the keys are on its disk; the last one names the buckets that are
+ ** then complete.
+ **/
+class HandoffStream
+{
+	// well below FrameReader::max_frame_size
+	static constexpr size_t max_batch_bytes = 1024 * 1024;
+	static constexpr int max_batch_ops = 1024;
 
-			setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+	int port;
+	uint64_t epoch;
+	int fd;
+	bool ok;
+	sockets::client_msg batch;
+	size_t batch_bytes = 0;
 
-			sockets::client_msg message;
-			server::server_response::reply server_response;
-			bool keep_running = true;
-			bool success = true;
+public:
+	std::vector<int> keys; // sent so far
 
-			char tmp[1] = "";
+	HandoffStream(int port, uint64_t epoch)
+		: port(port), epoch(epoch), fd(try_connect_to(port, server_address, 3)), ok(fd >= 0)
+	{
+		if (!ok)
+			fmt::print("handoff to {} NOT reachable\n", port);
+	}
 
-			while (true)
-			{
-				auto op_id = 0;
+	~HandoffStream()
+	{
+		if (fd >= 0)
+			close_socket(fd, 0);
+	}
 
-				// usleep(5);
+	HandoffStream(HandoffStream const &) = delete;
+	HandoffStream &operator=(HandoffStream const &) = delete;
 
-				if (recv(client_fd, tmp, 1, MSG_PEEK) <= 0) // work_recv_sock
-				{
-					// fmt::print("Break!\n");
-					break;
-				}
+	void add(int key, std::string_view value)
+	{
+		if (!ok)
+			return;
+		if (batch.ops_size() == max_batch_ops || (batch.ops_size() > 0 && batch_bytes + value.size() > max_batch_bytes))
+			send_batch();
+		auto *op = batch.add_ops();
+		op->set_type(sockets::client_msg_OperationType_HANDOFF);
+		op->set_key(key);
+		op->set_value(value.data(), value.size());
+		batch_bytes += value.size();
+		keys.push_back(key);
+	}
+
+	// sends the rest, returns false if the new owner did not take all keys
+	bool finish(std::vector<uint32_t> const &buckets)
+	{
+		if (batch.ops_size() == 0)
+			batch.add_ops()->set_type(sockets::client_msg_OperationType_HANDOFF);
+		batch.mutable_handed_over()->Assign(buckets.begin(), buckets.end());
+		send_batch();
+		return ok;
+	}
+
+private:
+	void send_batch()
+	{
+		if (!ok)
+			return;
+		batch.set_handoff_from(server_port);
+		batch.set_handoff_epoch(epoch);
+		send_clt_message(fd, batch);
+		server::server_response::reply reply;
+		ok = recv_svr_message(fd, &reply) && reply.success();
+		if (!ok)
+			fmt::print("handoff to {} failed\n", port);
+		batch.Clear();
+		batch_bytes = 0;
+	}
+};
+
+/**
+ ** Hands the keys of the moved buckets over to their new shards, see
+ ** BucketHandoffs. The other keys of the swapped out store go back into the
+ ** live one, unless a PUT got there first since it was swapped in. The
+ ** moved keys all come from a scan of RocksDB, once the write-back has
+ ** flushed the ones it still holds; they are deleted here after the new
+ ** owner has them on disk. epoch is the one of the table with the move.
+ **/
+void send_all(ServerOP *server_op, rocksdb::DB *rock_db, std::shared_ptr<KvStore> temp_local_kv,
+			  std::vector<bool> moved, uint64_t epoch)
+{
+	fmt::print("\n---redistribution---\n");
+
+	// the workers that loaded the store before it was swapped out may still
+	// write into it; once this is the last reference none of them does
+	while (temp_local_kv.use_count() > 1)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	std::atomic_thread_fence(std::memory_order_acquire);
+	// and the PUTs taken before the new table are committed, so the scan
+	// below sees them; a later PUT of a moved key goes to the new owner
+	worker_rounds.settle();
+
+	// the new owner of every moved bucket, 0 for the ones that stay after all
+	std::vector<int> owner_of(BucketMap::no_buckets, 0);
+	std::map<int, std::vector<uint32_t>> buckets_to;
+	std::vector<uint32_t> staying;
+	for (uint32_t bucket = 0; bucket < BucketMap::no_buckets; bucket++)
+	{
+		if (!moved[bucket])
+			continue;
+		if (auto owner = ownership.bucket_owner_elsewhere(bucket))
+		{
+			owner_of[bucket] = *owner;
+			buckets_to[*owner].push_back(bucket);
+		}
+		else
+			staying.push_back(bucket);
+	}
+	handoffs.handed_over(staying);
+
+	size_t no_moved = 0, no_kept = 0;
+	{
+		Epoch::Guard guard; // for the whole walk, see KvStore::init_it()
+		temp_local_kv->init_it();
+		// -1 ends the keys, 0 is a key
+		auto live_kv = server_op->get_local_kv();
+		for (int kv = temp_local_kv->get_next_key(); kv != -1; kv = temp_local_kv->get_next_key())
+		{
+			if (owner_of[BucketMap::bucket_of(kv)] != 0)
+				continue;
+			std::string value;
+			temp_local_kv->get(kv, &value);
+			// not over a newer value that came and went since the swap
+			if (live_kv->admit(kv, value, live_kv->first_version()))
+				no_kept++;
+		}
+	}
+	if (write_back)
+		write_back->flush();
+
+	std::map<int, HandoffStream> streams;
+	for (auto const &[port, buckets] : buckets_to)
+		streams.try_emplace(port, port, epoch);
+	rocksdb::ReadOptions read_options;
+	read_options.total_order_seek = true; // also with a hash index
+	std::unique_ptr<rocksdb::Iterator> it(rock_db->NewIterator(read_options));
+	for (it->SeekToFirst(); it->Valid(); it->Next())
+	{
+		auto key = EncodedKey::decode(it->key());
+		if (!key || owner_of[BucketMap::bucket_of(*key)] == 0)
+			continue;
+		streams.find(owner_of[BucketMap::bucket_of(*key)])->second.add(*key, std::string_view(it->value().data(), it->value().size()));
+	}
+	it.reset();
+
+	for (auto &[port, stream] : streams)
+	{
+		auto const &buckets = buckets_to[port];
+		if (!stream.finish(buckets))
+		{
+			// still served from here, until a later move of them succeeds
+			fmt::print("kept the keys of {} buckets for {}\n", buckets.size(), port);
+			continue;
+		}
+		// the GETs that saw the bucket still here and miss the deleted keys
+		// go on to the new owner, see moving_elsewhere()
+		handoffs.handed_over(buckets);
+		rocksdb::WriteBatch deletes;
+		auto kv = server_op->get_local_kv();
+		for (auto key : stream.keys)
+		{
+			deletes.Delete(EncodedKey(key));
+			kv->erase(key);
+		}
+		rocksdb::WriteOptions write_options;
+		write_options.sync = true;
+		if (auto rock_s = rock_db->Write(write_options, &deletes); !rock_s.ok())
+			fmt::print("### {}: deleting the keys handed over to {} ###\n", rock_s.ToString(), port);
+		no_moved += stream.keys.size();
+	}
+	fmt::print("end of redistribution, {} keys moved and {} kept\n", no_moved, no_kept);
+}
+
+// takes over the keys of a HANDOFF, see BucketHandoffs::take_over()
+void handle_handoff(ServerOP *server_op, Connection &conn, sockets::client_msg const &message)
+{
+	auto &reply = *google::protobuf::Arena::CreateMessage<server::server_response::reply>(&conn.get_arena());
+	reply.set_op_id(0);
+	reply.set_success(true);
+	handoffs.take_over(*server_op->get_local_kv(), message);
+	if (group_commit)
+		conn.await_commit(); // the old owner deletes the keys once it has the reply
+	fmt::print("HANDOFF < {} keys from {}, {} buckets complete >\n", message.ops_size(), message.handoff_from(),
+			   message.handed_over_size());
+	conn.queue_message(reply);
+}
 
-				recv_clt_message(client_fd, &message);
+/**
+ ** Runs every op of a client_msg batch in order and answers with one
+ ** server_response that has a reply per op. The PUTs go to RocksDB as one
+ ** WriteBatch. The GETs take the tiered_get path, the ones that reach
+ ** RocksDB all read one snapshot of it; a GET that follows a PUT on its key
+ ** in the same batch sees that PUT. Big values stay pinned in
+ ** RocksDB and are sent from there by reference.
+ **/
+void handle_batch(ServerOP *server_op, rocksdb::DB &rock_db, Connection &conn, sockets::client_msg const &message)
+{
+	auto &response = *google::protobuf::Arena::CreateMessage<server::server_response>(&conn.get_arena());
+	// reused across the batches of this worker
+	thread_local std::vector<int> get_reps;
+	thread_local std::vector<EncodedKey> get_keys;
+	thread_local std::vector<uint64_t> get_versions; // see tiered_get()
+	thread_local std::vector<std::pair<int, std::shared_ptr<rocksdb::PinnableSlice>>> pinned;
+	thread_local std::shared_ptr<rocksdb::PinnableSlice> spare;
+	std::unordered_map<int, std::string const *> written; // PUTs of this batch so far
+	int no_puts = 0;
+	uint64_t version = 0; // of a GET's key in the cache
 
-				std::string value;
-				int key = message.ops(0).key();
+	get_reps.clear();
+	get_keys.clear();
+	get_versions.clear();
+	pinned.clear();
+
+	for (auto const &op : message.ops())
+	{
+		auto *rep = response.add_reps();
+		rep->set_op_id(op.op_id());
+		rep->set_success(true);
 
-				switch (message.ops(0).type())
+		switch (op.type())
+		{
+		case sockets::client_msg_OperationType_PUT:
+			if (wrong_shard(op.key(), rep))
+				break;
+			load_tracker.count(op.key());
+			handoffs.claim(op.key());
+			if (write_back)
+			{
+				// in this order, see tiered_get()
+				write_back->put(op.key(), op.value());
+				server_op->local_kv_put(op.key(), op.value());
+			}
+			else
+			{
+				GroupCommit::stage(op.key(), op.value());
+				conn.await_commit();
+			}
+			no_puts++;
+			written.insert_or_assign(op.key(), &op.value());
+			rep->set_value(op.value());
+			break;
+		case sockets::client_msg_OperationType_GET:
+			if (wrong_shard(op.key(), rep, true))
+				break;
+			load_tracker.count(op.key());
+			if (auto it = written.find(op.key()); it != written.end())
+			{
+				rep->set_value(*it->second);
+				break;
+			}
+			if (group_commit)
+			{
+				if (auto staged = GroupCommit::staged_value(op.key()))
 				{
-				case sockets::client_msg_OperationType_GET:
-					value = get_db(rock_db, key);
-					value = server_op->local_kv_get(key);
-					fmt::print("GET < {} - {} >\n", key, value.c_str());
-					server_response.set_value(value);
-					server_response.set_op_id(1);
-					server_response.set_success(success);
-					send_svr_message(client_fd, server_response);
-					// server_response.PrintDebugString();
-					break;
-				case sockets::client_msg_OperationType_PUT:
-					value = message.ops(0).value();
-					success = server_op->local_kv_put(key, value);
-					success = put_db(rock_db, key, value);
-					server_response.set_value(value);
-					server_response.set_op_id(0);
-					server_response.set_success(success);
-					fmt::print("PUT < {} - {} > [{}]\n", key, value.c_str(), success);
-					send_svr_message(client_fd, server_response);
-					break;
-				case sockets::client_msg_OperationType_TXN_START:
-					auto temp_local_kv = server_op->get_local_kv();
-					server_op->local_kv_init_it();
-					std::thread(send_all, client_fd, temp_local_kv).detach();
-					server_op->reset_kv();
+					rep->set_value(staged->data(), staged->size());
+					conn.await_commit();
 					break;
 				}
 			}
-			// server_response.PrintDebugString();
-			close_socket(client_fd, 0);
+			version = server_op->local_kv_version(op.key());
+			if (server_op->local_kv_get(op.key(), rep->mutable_value()))
+				break;
+			if (write_back && write_back->get(op.key(), rep->mutable_value()))
+				break;
+			get_reps.push_back(response.reps_size() - 1);
+			get_keys.emplace_back(op.key());
+			get_versions.push_back(version);
+			break;
+		default:
+			rep->set_success(false);
+			break;
 		}
 	}
+
+	// the remaining GETs see the state from before the batch
+	if (!get_keys.empty())
+	{
+		rocksdb::ReadOptions read_options;
+		read_options.snapshot = rock_db.GetSnapshot();
+		for (size_t i = 0; i < get_reps.size(); i++)
+		{
+			if (spare == nullptr)
+				spare = std::make_shared<rocksdb::PinnableSlice>();
+			auto *rep = response.mutable_reps(get_reps[i]);
+			auto key = message.ops(get_reps[i]).key();
+			if (!rock_db.Get(read_options, rock_db.DefaultColumnFamily(), get_keys[i], spare.get()).ok())
+			{
+				if (!moving_elsewhere(key, rep))
+					rep->set_value("NOT-FOUND");
+				spare->Reset();
+				continue;
+			}
+			if (!handoffs.is_outgoing(key))
+				server_op->local_kv_admit(key, std::string_view(spare->data(), spare->size()), get_versions[i]);
+			if (spare->size() >= Connection::min_splice_size)
+				pinned.emplace_back(get_reps[i], std::move(spare)); // sent from the pinned block
+			else
+				rep->set_value(spare->data(), spare->size());
+			if (spare != nullptr)
+				spare->Reset();
+		}
+		rock_db.ReleaseSnapshot(read_options.snapshot);
+	}
+
+	fmt::print("BATCH < {} ops, {} PUTs >\n", message.ops_size(), no_puts);
+	if (pinned.empty())
+	{
+		conn.queue_message(response);
+		return;
+	}
+
+	// the reps with a pinned value get it appended by reference as their last
+	// field, which makes their length known only here
+	conn.begin_frame();
+	auto next_pinned = pinned.begin();
+	for (int i = 0; i < response.reps_size(); i++)
+	{
+		auto const &rep = response.reps(i);
+		if (next_pinned == pinned.end() || next_pinned->first != i)
+		{
+			conn.append_field_header(server::server_response::kRepsFieldNumber, rep.ByteSizeLong());
+			conn.append_message(rep);
+			continue;
+		}
+
+		std::string_view value(next_pinned->second->data(), next_pinned->second->size());
+		conn.append_field_header(server::server_response::kRepsFieldNumber,
+								 rep.ByteSizeLong() + Connection::bytes_field_size(server::server_response::reply::kValueFieldNumber, value.size()));
+		conn.append_message(rep);
+		conn.append_bytes_field(server::server_response::reply::kValueFieldNumber, value, std::move(next_pinned->second));
+		++next_pinned;
+	}
+	conn.end_frame();
 }
 
-void listen_for_connections()
+bool handle_request(ServerOP *server_op, rocksdb::DB &rock_db, Connection &conn, char const *payload, size_t msg_size)
 {
+	// both live on the connection's arena, which is reset once the batch of
+	// frames this one belongs to has been handled
+	auto &message = *google::protobuf::Arena::CreateMessage<sockets::client_msg>(&conn.get_arena());
+	auto &server_response = *google::protobuf::Arena::CreateMessage<server::server_response::reply>(&conn.get_arena());
+	bool success = true;
+	auto started = std::chrono::steady_clock::now();
+
+	if (!message.ParseFromArray(payload, msg_size) || message.ops_size() == 0)
+	{
+		fmt::print("ParseFromArray\n");
+		return false;
+	}
+
+	// keys of moved buckets from their old shard, see send_all()
+	if (message.has_handoff_from())
+	{
+		handle_handoff(server_op, conn, message);
+		return true;
+	}
+
+	if (message.ops_size() > 1)
+	{
+		handle_batch(server_op, rock_db, conn, message);
+		load_tracker.took(std::chrono::steady_clock::now() - started);
+		return true;
+	}
+
+	// pushed by the master on every change, with a TXN_START if keys move
+	if (message.has_routing())
+		update_ownership(message);
+
+	auto const &op = message.ops(0);
+	int key = op.key();
+
+	// echoed back, so pipelining clients can match replies to requests
+	server_response.set_op_id(op.op_id());
+
+	if ((op.type() == sockets::client_msg_OperationType_GET || op.type() == sockets::client_msg_OperationType_PUT) &&
+		wrong_shard(key, &server_response, op.type() == sockets::client_msg_OperationType_GET))
+	{
+		conn.queue_message(server_response);
+		return true;
+	}
+
+	switch (op.type())
+	{
+	case sockets::client_msg_OperationType_GET:
+		load_tracker.count(key);
+		if (!tiered_get(server_op, rock_db, conn, key, server_response.mutable_value()))
+		{
+			if (moving_elsewhere(key, &server_response))
+			{
+				conn.queue_message(server_response);
+				break;
+			}
+			server_response.set_value("NOT-FOUND");
+		}
+		fmt::print("GET < {} - {} >\n", key, server_response.value());
+		server_response.set_success(success);
+		conn.queue_message(server_response);
+		load_tracker.took(std::chrono::steady_clock::now() - started);
+		// server_response.PrintDebugString();
+		break;
+	case sockets::client_msg_OperationType_PUT:
+		handoffs.claim(key);
+		if (write_back)
+		{
+			// acknowledged before it is on disk; the write-back first, so a GET
+			// that misses it finds the cache changed, see tiered_get()
+			write_back->put(key, op.value());
+			success = server_op->local_kv_put(key, op.value());
+		}
+		else
+		{
+			GroupCommit::stage(key, op.value()); // the reply and the KvStore wait for its commit
+			conn.await_commit();
+		}
+		server_response.set_value(op.value());
+		server_response.set_success(success);
+		fmt::print("PUT < {} - {} > [{}]\n", key, op.value(), success);
+		conn.queue_message(server_response);
+		load_tracker.count(key);
+		load_tracker.took(std::chrono::steady_clock::now() - started);
+		break;
+	case sockets::client_msg_OperationType_TXN_START:
+	{
+		// indexed by bucket, all of them if none are named
+		std::vector<bool> moved(BucketMap::no_buckets, message.moved_buckets_size() == 0);
+		for (auto bucket : message.moved_buckets())
+			if (bucket < BucketMap::no_buckets)
+				moved[bucket] = true;
+		std::thread(send_all, server_op, &rock_db, server_op->take_local_kv(), std::move(moved), message.routing().epoch())
+			.detach();
+		break;
+	}
+	default:
+		break;
+	}
+	return true;
+}
+
+void server_worker(int listen_fd, ServerOP *server_op, rocksdb::DB &rock_db)
+{
+	worker_rounds.join();
+	auto handler = [server_op, &rock_db](Connection &conn, char const *payload, size_t msg_size)
+	{
+		worker_rounds.begin();
+		return handle_request(server_op, rock_db, conn, payload, msg_size);
+	};
+	// the PUTs of a whole loop round go to RocksDB together, before any reply
+	commit_handler commit = [server_op]
+	{
+		bool committed = !group_commit || commit_db(server_op);
+		worker_rounds.end();
+		return committed;
+	};
+
+#if defined(SVR_IO_URING)
+	if (use_io_uring)
+	{
+		UringLoop uring_loop(listen_fd, handler, commit);
+		uring_loop.run();
+	}
+#endif
+	EventLoop event_loop(listen_fd, handler, commit);
+	event_loop.run();
+}
+
+/**
+ ** Reports the load of the server to the master every interval seconds:
+ ** GETs and PUTs per second, the busiest buckets, the 99th percentile of
+ ** the request times and RocksDB's estimates of its keys and bytes.
+ **/
+void heartbeat(rocksdb::DB *rock_db, unsigned interval)
+{
+	auto last = std::chrono::steady_clock::now();
 	while (true)
 	{
-		accept_connections(server_port, &connections, 0);
-		fmt::print("Connections: {} - last {}\n", connections.size(), connections.back());
+		sleep(interval);
+		auto now = std::chrono::steady_clock::now();
+		std::chrono::duration<double> elapsed = now - last;
+		last = now;
+
+		sockets::client_msg message;
+		message.add_ops()->set_type(sockets::client_msg_OperationType_HEARTBEAT);
+		auto *load = message.mutable_load();
+		load->set_port(server_port);
+		load_tracker.collect(elapsed.count(), load);
+		uint64_t sst_bytes = 0, memtable_bytes = 0, keys = 0;
+		rock_db->GetIntProperty("rocksdb.estimate-live-data-size", &sst_bytes);
+		rock_db->GetIntProperty("rocksdb.cur-size-all-mem-tables", &memtable_bytes);
+		rock_db->GetIntProperty("rocksdb.estimate-num-keys", &keys);
+		load->set_bytes(sst_bytes + memtable_bytes);
+		load->set_keys(keys);
+
+		int master_fd = try_connect_to(master_port, server_address, 3);
+		if (master_fd < 0)
+			continue;
+		send_clt_message(master_fd, message);
+		close_socket(master_fd, 0);
 	}
 }
 
@@ -240,13 +1273,18 @@ void master_connection()
 	fmt::print("\nRegistert on master with {}\n", server_port);
 	fmt::print("------------------------------\n");
 	// message.PrintDebugString();
+
+	// the master answers with the routing table that includes this server
+	sockets::client_msg reply;
+	if (recv_clt_message(sock_fd, &reply) && reply.has_routing())
+		update_ownership(reply);
 	close_socket(sock_fd, 0);
 }
 
 auto main(int argc, char *argv[]) -> int
 {
 	cxxopts::Options options(argv[0], "Server for the sockets benchmark");
-	options.allow_unrecognised_options().add_options()("p,PORT", "port at which the server listens to client or master requests", cxxopts::value<size_t>())("m,MASTER_PORT", "port at which the master server is listening", cxxopts::value<size_t>())("h,help", "Print help");
+	options.allow_unrecognised_options().add_options()("p,PORT", "port at which the server listens to client or master requests", cxxopts::value<size_t>())("m,MASTER_PORT", "port at which the master server is listening", cxxopts::value<size_t>())("t,threads", "number of worker threads, each with its own listener and event loop on PORT", cxxopts::value<size_t>()->default_value("1"))("io", "transport backend of the event loops: epoll or uring", cxxopts::value<std::string>()->default_value("epoll"))("durability", "when a PUT is acknowledged: sync (once RocksDB has synced it, committed in groups), group or async (after the KvStore update; a background flusher persists it, synced to disk with group)", cxxopts::value<std::string>()->default_value("sync"))("flush-interval", "milliseconds between two write-back flushes with group or async durability", cxxopts::value<size_t>()->default_value("10"))("rocksdb-profile", "RocksDB tuning, one of " + rocksdb_profile_names(), cxxopts::value<std::string>()->default_value("default"))("rocksdb-options", "RocksDB OPTIONS file to use instead of a profile", cxxopts::value<std::string>())("cache-bytes", "memory limit of the in-memory KvStore in bytes, 0 for none; the clean keys beyond it are evicted and read from RocksDB again", cxxopts::value<size_t>()->default_value("0"))("heartbeat", "seconds between two load reports to the master, 0 for none", cxxopts::value<unsigned>()->default_value("5"))("h,help", "Print help");
 
 	auto args = options.parse(argc, argv);
 
@@ -271,26 +1309,66 @@ auto main(int argc, char *argv[]) -> int
 	server_port = args["PORT"].as<size_t>();
 	master_port = args["MASTER_PORT"].as<size_t>();
 	server_address = "127.0.0.1";
+	no_threads = std::max<size_t>(1, args["threads"].as<size_t>());
+
+	if (args["io"].as<std::string>() == "uring")
+	{
+#if defined(SVR_IO_URING)
+		use_io_uring = UringLoop::supported();
+		if (!use_io_uring)
+			fmt::print(stderr, "io_uring is not available on this kernel, falling back to epoll\n");
+#else
+		fmt::print(stderr, "svr was built without SVR_IO_URING, falling back to epoll\n");
+#endif
+	}
+
+	auto mode = parse_durability(args["durability"].as<std::string>());
+	if (!mode)
+	{
+		fmt::print(stderr, "The durability is one of sync, group or async\n{}\n", options.help());
+		return 0;
+	}
 
 	// auto id = threads_ids.fetch_add(1);
 	// ServerThread m_thread(id);
 
+	// for settle_on_signal(); blocked before RocksDB starts its threads, which
+	// would die of it
+	sigset_t settle_signals;
+	sigemptyset(&settle_signals);
+	sigaddset(&settle_signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &settle_signals, nullptr);
+
 	rocksdb::DB *rock_db;
 	rocksdb::Options rock_options;
 	rocksdb::Status rock_s;
 
-	rock_options.IncreaseParallelism(); // no_threads);
-	rock_options.OptimizeLevelStyleCompaction();
-	rock_options.compression_per_level.resize(rock_options.num_levels);
-	rock_options.create_if_missing = true;
-
-	for (int i = 0;
-		 i < rock_options.num_levels; i++)
+	if (args.count("rocksdb-options"))
 	{
-		rock_options.compression_per_level[i] = rocksdb::kNoCompression;
+		auto file = args["rocksdb-options"].as<std::string>();
+		rock_s = load_rocksdb_options(file, &rock_options);
+		if (!rock_s.ok())
+		{
+			fmt::print(stderr, "Cannot load the RocksDB options from {}: {}\n", file, rock_s.ToString());
+			return 1;
+		}
+		fmt::print("RocksDB options from {}\n", file);
 	}
+	else if (auto profile = args["rocksdb-profile"].as<std::string>(); !apply_rocksdb_profile(profile, &rock_options))
+	{
+		fmt::print(stderr, "The RocksDB profile is one of {}\n{}\n", rocksdb_profile_names(), options.help());
+		return 0;
+	}
+	else
+		fmt::print("RocksDB profile {}\n", profile);
 
-	rock_options.compression = rocksdb::kNoCompression;
+	rock_options.create_if_missing = true;
+	rock_stats = rocksdb::CreateDBStatistics();
+	rock_options.statistics = rock_stats;
+	rock_options.comparator = KeyComparator::get();
+	// the WAL write of a group overlaps with the memtable inserts of the previous one
+	rock_options.enable_pipelined_write = true;
+	rock_options.allow_concurrent_memtable_write = true;
 
 	std::string root;
 	std::filesystem::path cwd = std::filesystem::current_path();
@@ -304,23 +1382,44 @@ auto main(int argc, char *argv[]) -> int
 			break;
 	}
 	fmt::print("\nRockDB is {} at {}\n", rock_s.ToString().c_str(), root.c_str());
+	if (rock_s.IsInvalidArgument() || (rock_s.ok() && holds_decimal_keys(*rock_db)))
+	{
+		// a DB from before the fixed-width keys
+		fmt::print(stderr, "Run ./build/dev/migrate-keys on the rockDBs directory first\n");
+		exit(1);
+	}
 	assert(rock_s.ok());
 
+	if (*mode != durability::sync)
+		write_back = std::make_unique<WriteBack>(*rock_db, *mode, std::chrono::milliseconds(args["flush-interval"].as<size_t>()), max_dirty_bytes);
+	else
+	{
+		rocksdb::WriteOptions write_options;
+		write_options.sync = true;
+		group_commit = std::make_unique<GroupCommit>(*rock_db, write_options);
+	}
+
 	std::vector<std::thread> threads;
 
-	ServerOP server_op;
+	ServerOP server_op(args["cache-bytes"].as<size_t>());
 	server_op.local_kv_init_it();
 
-	timeout.tv_sec = 3;	 // 3;
-	timeout.tv_usec = 0; // 5 * 1000 * 100;
+	// one SO_REUSEPORT listener per worker, so the kernel spreads the
+	// connections across the event loops; bind all of them before
+	// registering, so the master never finds the port closed
+	std::vector<int> listen_fds;
+	for (int i = 0; i < no_threads; i++)
+		listen_fds.push_back(listen_on(server_port, 0));
 
 	master_connection();
 
-	for (int i = 0; i < 1; i++) // 4
-		threads.emplace_back(listen_for_connections);
+	std::thread(report_stats, &server_op).detach();
+	std::thread(settle_on_signal, rock_db, settle_signals).detach();
+	if (auto interval = args["heartbeat"].as<unsigned>(); interval > 0)
+		std::thread(heartbeat, rock_db, interval).detach();
 
-	for (int i = 0; i < 1; i++) // 1
-		threads.emplace_back(server_worker, &server_op, std::ref(*rock_db));
+	for (int i = 0; i < no_threads; i++)
+		threads.emplace_back(server_worker, listen_fds[i], &server_op, std::ref(*rock_db));
 
 	for (auto &thread : threads)
 	{
@@ -1,8 +1,11 @@
+#include <array>
+#include <cerrno>
 #include <cstdint>
 #include <memory>
 #include <optional>
 #include <utility>
 
+#include "frame_reader.h"
 #include "shared.h"
 #include <message.h>
 
@@ -10,7 +13,10 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <fmt/printf.h>
 #include <iostream>
 
@@ -29,28 +35,30 @@ inline auto destruct_message(char *msg, size_t bytes)
 static auto read_n(int fd, char *buffer, size_t n) -> size_t
 {
 	size_t bytes_read = 0;
-	size_t retries = 0;
-	constexpr size_t max_retries = 10000;
 	while (bytes_read < n)
 	{
 		auto bytes_left = n - bytes_read;
 		auto bytes_read_now = recv(fd, buffer + bytes_read, bytes_left, 0);
-		// negative return_val means that there are no more data (fine for non
-		// blocking socket)
-		if (bytes_read_now == 0)
+		if (bytes_read_now > 0)
 		{
-			if (retries >= max_retries)
-			{
-				return bytes_read;
-			}
-			++retries;
+			bytes_read += bytes_read_now;
 			continue;
 		}
-		if (bytes_read_now > 0)
+		// the peer closed the connection, no more data will ever come
+		if (bytes_read_now == 0)
+			return bytes_read;
+		if (errno == EINTR)
+			continue;
+		// a non blocking socket without data yet: sleep until it has some
+		// instead of spinning on recv()
+		if ((errno == EAGAIN || errno == EWOULDBLOCK) && (fcntl(fd, F_GETFL) & O_NONBLOCK) != 0)
 		{
-			bytes_read += bytes_read_now;
-			retries = 0;
+			pollfd pfd{fd, POLLIN, 0};
+			poll(&pfd, 1, -1);
+			continue;
 		}
+		// receive timeout (SO_RCVTIMEO) or a broken connection
+		return bytes_read;
 	}
 	return bytes_read;
 }
@@ -92,6 +100,28 @@ auto secure_recv(int fd) -> std::pair<size_t, std::unique_ptr<char[]>>
 	return {actual_msg_size, std::move(buf)};
 }
 
+auto recv_frame(int fd) -> std::optional<BufferPool::Buffer>
+{
+	char dlen[length_size_field];
+	if (read_n(fd, dlen, length_size_field) != length_size_field)
+		return std::nullopt;
+
+	auto msg_size = convert_byte_array_to_int(dlen);
+	// the same limit as the event loops', not whatever a peer announces
+	if (msg_size > FrameReader::max_frame_size)
+	{
+		debug_print("[{}] frame of {} bytes is too big\n", __func__, msg_size);
+		return std::nullopt;
+	}
+	auto buf = BufferPool::local().acquire(msg_size);
+	if (read_n(fd, buf.get(), msg_size) != msg_size)
+	{
+		debug_print("[{}] Length of message is incorrect expected {}\n", __func__, msg_size);
+		return std::nullopt;
+	}
+	return buf;
+}
+
 auto secure_send(int fd, char *data, size_t len) -> std::optional<size_t>
 {
 	auto bytes = 0LL;
@@ -117,7 +147,60 @@ auto secure_send(int fd, char *data, size_t len) -> std::optional<size_t>
 	return len;
 }
 
+auto secure_sendv(int fd, iovec *iov, size_t iovcnt) -> std::optional<size_t>
+{
+	size_t total = 0;
+
+	while (iovcnt > 0)
+	{
+		msghdr msg{};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		auto bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (bytes < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return std::nullopt;
+		}
+		total += bytes;
+
+		// skip what went out, a partially sent iovec is resumed
+		while (iovcnt > 0 && static_cast<size_t>(bytes) >= iov->iov_len)
+		{
+			bytes -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = static_cast<char *>(iov->iov_base) + bytes;
+			iov->iov_len -= bytes;
+		}
+	}
+
+	return total;
+}
+
 int connect_to(int port, std::string server_address, int flag, int timeout_flag)
+{
+	if (flag == 1)
+		fmt::print("Try to connect to {} on {} ..\n", server_address, port);
+
+	int sock_fd = try_connect_to(port, server_address, timeout_flag);
+	if (sock_fd < 0)
+	{
+		std::cout << "connect Errno: " << errno << std::endl;
+		exit(1); // return -1;
+	}
+
+	if (flag == 1)
+		fmt::print("connect succeeded on sockfd {} ..\n", sock_fd);
+
+	return sock_fd;
+}
+
+int try_connect_to(int port, std::string const &server_address, int timeout_flag)
 {
 	// init sock_fd -------------------------------------
 	int sock_fd;
@@ -127,9 +210,6 @@ int connect_to(int port, std::string server_address, int flag, int timeout_flag)
 		exit(1);
 	}
 
-	if (flag == 1)
-		fmt::print("Try to connect to {} on {} ..\n", server_address, port);
-
 	sockaddr_in master_addr{};
 	master_addr.sin_family = AF_INET;
 	master_addr.sin_port = htons(port);
@@ -145,17 +225,16 @@ int connect_to(int port, std::string server_address, int flag, int timeout_flag)
 	// usleep(5 * 1000 * 100);
 	if ((connect(sock_fd, (struct sockaddr *)&master_addr, sizeof(master_addr))) < 0)
 	{
-		std::cout << "connect Errno: " << errno << std::endl;
-		exit(1); // return -1;
+		ErrNo err;
+		close(sock_fd);
+		errno = err.get_err_no();
+		return -1;
 	}
 
-	if (flag == 1)
-		fmt::print("connect succeeded on sockfd {} ..\n", sock_fd);
-
 	return sock_fd;
 }
 
-void accept_connections(int port, std::vector<int> *connections, int flag)
+int listen_on(int port, int flag)
 {
 	int listen_fd;
 	// init recv_sockfd -------------------------------------
@@ -182,11 +261,6 @@ void accept_connections(int port, std::vector<int> *connections, int flag)
 		exit(1);
 	}
 
-	struct timeval timeout;
-	timeout.tv_sec = 5;
-	timeout.tv_usec = 0;
-	// setsockopt(listen_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
-
 	// Setting server byte order; declare (local)host IP address;
 	// set and convert port number (into network byte order)
 	struct sockaddr_in srv_addr; // getaddrinfo
@@ -204,13 +278,35 @@ void accept_connections(int port, std::vector<int> *connections, int flag)
 		exit(1);
 	}
 
-	// lets the socket listen for upto 5 connections
-	if ((listen(listen_fd, 5)) == -1)
+	// a burst of one-shot clients must not overflow the accept queue
+	if ((listen(listen_fd, SOMAXCONN)) == -1)
 	{
 		fmt::printf("listen\n");
 		exit(1);
 	}
 
+	if (flag == 1)
+		fmt::print("{} listening on {} ..\n", listen_fd, port);
+
+	return listen_fd;
+}
+
+void set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		fmt::print("fcntl\n");
+		std::cout << "Errno: " << errno << std::endl;
+		exit(1);
+	}
+}
+
+void accept_connections(int port, ConnectionQueue *connections, int flag)
+{
+	int listen_fd = listen_on(port, flag);
+	struct sockaddr_in srv_addr;
+
 	if (flag == 1)
 		fmt::print("{} waiting for new connections on {} ..\n", listen_fd, port);
 
@@ -229,12 +325,13 @@ void accept_connections(int port, std::vector<int> *connections, int flag)
 			std::cout << "Errno: " << errno << std::endl;
 			still_listening = false;
 			// return -1;
+			continue;
 		}
 
 		if (flag == 1)
 			fmt::print("accept succeeded on sockfd {} {} ..\n", connected_fd, listen_fd);
 
-		connections->push_back(connected_fd);
+		connections->push(connected_fd);
 	}
 
 	close_socket(listen_fd, flag);
@@ -244,88 +341,72 @@ void accept_connections(int port, std::vector<int> *connections, int flag)
 
 bool recv_clt_message(int sockfd, sockets::client_msg *message)
 {
-	auto [bytecount, result] = secure_recv(sockfd);
-
-	if (static_cast<int>(bytecount) <= 0 || result == nullptr)
+	auto frame = recv_frame(sockfd);
+	if (!frame)
 	{
 		return false;
 	}
 
-	sockets::client_msg temp_msg;
-	auto payload_sz = bytecount;
-	std::string buffer(result.get(), payload_sz);
-
-	if (!temp_msg.ParseFromString(buffer))
+	if (!message->ParseFromArray(frame->get(), frame->size()))
 	{
-		fmt::print("ParseFromString\n");
+		fmt::print("ParseFromArray\n");
 		exit(1);
 	}
 
-	if (!temp_msg.IsInitialized())
+	if (!message->IsInitialized())
 	{
 		fmt::print("IsInitialized\n");
 		exit(1);
 	}
 
-	*message = temp_msg;
 	return true;
 }
 
 bool recv_svr_message(int sockfd, server::server_response::reply *message)
 {
-	auto [bytecount, result] = secure_recv(sockfd);
-
-	if (static_cast<int>(bytecount) <= 0 || result == nullptr)
+	auto frame = recv_frame(sockfd);
+	if (!frame)
 	{
 		return false;
 	}
 
-	server::server_response::reply temp_msg;
-	auto payload_sz = bytecount;
-	std::string buffer(result.get(), payload_sz);
-
-	if (!temp_msg.ParseFromString(buffer))
+	if (!message->ParseFromArray(frame->get(), frame->size()))
 	{
-		fmt::print("ParseFromString\n");
+		fmt::print("ParseFromArray\n");
 		exit(1);
 	}
 
-	if (!temp_msg.IsInitialized())
+	if (!message->IsInitialized())
 	{
 		fmt::print("IsInitialized\n");
 		exit(1);
 	}
 
-	*message = temp_msg;
 	return true;
 }
 
-void send_clt_message(int sockfd, sockets::client_msg message)
+// serializes the message straight behind its length field in a pooled buffer
+static void send_message(int sockfd, google::protobuf::MessageLite const &message)
 {
-	std::string msg_str;
-	message.SerializeToString(&msg_str);
+	auto msg_size_payload = message.ByteSizeLong();
+	auto buf = BufferPool::local().acquire(msg_size_payload);
+	message.SerializeToArray(buf.get(), msg_size_payload);
 
-	auto msg_size_payload = msg_str.size();
-	auto buf = std::make_unique<char[]>(msg_size_payload + length_size_field);
-	construct_message(buf.get(), msg_str.c_str(), msg_size_payload);
-	// convert_int_to_byte_array(buf.get(), msg_size);
-	// memcpy(buf.get() + length_size_field, msg_str.data(), msg_size);
+	char dlen[length_size_field];
+	convert_int_to_byte_array(dlen, msg_size_payload);
 
-	secure_send(sockfd, buf.get(), msg_size_payload + length_size_field);
+	std::array<iovec, 2> iov{{{dlen, length_size_field}, {buf.get(), buf.size()}}};
+	secure_sendv(sockfd, iov.data(), iov.size());
 }
 
-void send_svr_message(int sockfd, server::server_response::reply message)
+void send_clt_message(int sockfd, sockets::client_msg const &message)
 {
-	std::string msg_str;
-	message.SerializeToString(&msg_str);
-
-	auto msg_size_payload = msg_str.size();
-	auto buf = std::make_unique<char[]>(msg_size_payload + length_size_field);
-	construct_message(buf.get(), msg_str.c_str(), msg_size_payload);
-	// convert_int_to_byte_array(buf.get(), msg_size);
-	// memcpy(buf.get() + length_size_field, msg_str.data(), msg_size);
+	send_message(sockfd, message);
+}
 
-	secure_send(sockfd, buf.get(), msg_size_payload + length_size_field);
+void send_svr_message(int sockfd, server::server_response::reply const &message)
+{
+	send_message(sockfd, message);
 }
 
 void close_socket(int sockfd, int flag)
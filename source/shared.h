@@ -10,8 +10,12 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <message.h>
 
+#include "buffer_pool.h"
+#include "mpmc_queue.h"
+
 #if !defined(NDEBUG)
 #include <fmt/format.h>
 #if 0
@@ -108,11 +112,23 @@ public:
 [[nodiscard]] auto secure_recv(int fd)
     -> std::pair<size_t, std::unique_ptr<char[]>>;
 
+/**
+ ** Like secure_recv but the payload lands in a buffer of the calling thread's
+ ** BufferPool. It returns nullopt if the connection broke.
+ **/
+[[nodiscard]] auto recv_frame(int fd) -> std::optional<BufferPool::Buffer>;
+
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
 extern hostent *hostip;
 
 auto secure_send(int fd, char *data, size_t len) -> std::optional<size_t>;
 
+/**
+ ** Sends all the iovecs with as few sendmsg() calls as the socket allows. It
+ ** updates iov while doing so and returns nullopt if the connection broke.
+ **/
+auto secure_sendv(int fd, iovec *iov, size_t iovcnt) -> std::optional<size_t>;
+
 /**
  * It constructs the message to be sent.
  * It takes as arguments a destination char ptr, the payload (data to be
@@ -131,10 +147,17 @@ inline void construct_message(char *dst, const char *payload,
 }
 
 int connect_to(int port, std::string server_address, int flag, int timeout_flag);
-void accept_connections(int port, std::vector<int> *connections, int flag);
+/**
+ ** Like connect_to but it returns -1, with errno set, if the peer cannot be
+ ** reached instead of exiting.
+ **/
+int try_connect_to(int port, std::string const &server_address, int timeout_flag);
+int listen_on(int port, int flag);
+void set_nonblocking(int fd);
+void accept_connections(int port, ConnectionQueue *connections, int flag);
 bool recv_clt_message(int sockfd, sockets::client_msg *message);
 bool recv_svr_message(int sockfd, server::server_response::reply *message);
-void send_clt_message(int sockfd, sockets::client_msg message);
-void send_svr_message(int sockfd, server::server_response::reply message);
+void send_clt_message(int sockfd, sockets::client_msg const &message);
+void send_svr_message(int sockfd, server::server_response::reply const &message);
 void close_socket(int sock_fd, int flag);
 void close_sockets(int recv_sockfd, int send_sockfd, int flag);
\ No newline at end of file
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+/**
+ ** Size-class allocator for the KvStore value blocks. Blocks of a class are
+ ** carved from 64 KiB slabs, which never go back to the system: a
+ ** long-running store that keeps overwriting its values reuses the same
+ ** blocks instead of fragmenting the heap. The classes are 16 bytes apart up
+ ** to 128 bytes and eight per power of two up to 4 KiB, so a block wastes
+ ** less than an eighth of its size; larger blocks come from operator new.
+ **
+ ** Every thread allocates from and frees into its own magazine per class.
+ ** Only an empty or full magazine goes to the shared free list of its
+ ** class, for half a magazine of blocks at a time.
+ **/
+class SlabAllocator {
+public:
+  struct Stats {
+    size_t reserved;  // slabs, plus the blocks too large for a class
+    size_t allocated; // blocks in use, rounded up to their class
+    size_t requested; // bytes asked for by the blocks in use
+  };
+
+  static auto allocate(size_t bytes) -> void * {
+    auto &cache = local();
+    cache.count(bytes, +1);
+    if (bytes > max_class_size) {
+      reserved_large.fetch_add(bytes, std::memory_order_relaxed);
+      return ::operator new(bytes);
+    }
+    auto &magazine = cache.magazines[class_of(bytes)];
+    if (magazine.empty()) {
+      refill(class_of(bytes), &magazine);
+    }
+    auto *block = magazine.back();
+    magazine.pop_back();
+    return block;
+  }
+
+  // bytes as passed to allocate()
+  static void deallocate(void *block, size_t bytes) {
+    auto &cache = local();
+    cache.count(bytes, -1);
+    if (bytes > max_class_size) {
+      reserved_large.fetch_sub(bytes, std::memory_order_relaxed);
+      ::operator delete(block);
+      return;
+    }
+    auto &magazine = cache.magazines[class_of(bytes)];
+    if (magazine.size() == magazine_size) {
+      drain(class_of(bytes), &magazine, magazine_size / 2);
+    }
+    magazine.push_back(block);
+  }
+
+  // what allocate(bytes) takes up
+  static auto block_size(size_t bytes) -> size_t {
+    return bytes > max_class_size ? bytes : class_size(class_of(bytes));
+  }
+
+  static auto stats() -> Stats {
+    auto &reg = registry();
+    std::lock_guard<std::mutex> l(reg.mtx);
+    auto allocated = reg.exited_allocated;
+    auto requested = reg.exited_requested;
+    for (auto const *cache : reg.caches) {
+      allocated += cache->allocated.load(std::memory_order_relaxed);
+      requested += cache->requested.load(std::memory_order_relaxed);
+    }
+    return {reg.slab_bytes + reserved_large.load(std::memory_order_relaxed),
+            static_cast<size_t>(allocated), static_cast<size_t>(requested)};
+  }
+
+private:
+  static constexpr size_t slab_bytes = 64 * 1024;
+  static constexpr size_t magazine_size = 32;
+  static constexpr size_t fine_classes = 8; // 16, 32, ..., 128
+  static constexpr size_t max_class_size = 4096;
+  static constexpr size_t classes_per_doubling = 8;
+  static constexpr size_t no_classes =
+      fine_classes + classes_per_doubling * 5; // up to 2^12
+
+  static auto class_of(size_t bytes) -> size_t {
+    if (bytes <= 128) {
+      return bytes == 0 ? 0 : (bytes - 1) / 16;
+    }
+    // 2^(p-1) < bytes <= 2^p, in eighths of 2^(p-1)
+    auto p = static_cast<size_t>(std::bit_width(bytes - 1));
+    auto step = (size_t{1} << (p - 1)) / classes_per_doubling;
+    auto index = (bytes - (size_t{1} << (p - 1)) + step - 1) / step - 1;
+    return fine_classes + (p - 8) * classes_per_doubling + index;
+  }
+
+  static auto class_size(size_t size_class) -> size_t {
+    if (size_class < fine_classes) {
+      return 16 * (size_class + 1);
+    }
+    auto base = size_t{128}
+                << ((size_class - fine_classes) / classes_per_doubling);
+    return base + ((size_class - fine_classes) % classes_per_doubling + 1) *
+                      base / classes_per_doubling;
+  }
+
+  // one per thread; the counters may go negative, a block can be freed by
+  // another thread than the one that allocated it
+  struct Cache {
+    Cache();
+    ~Cache();
+
+    void count(size_t bytes, int sign) {
+      allocated.store(allocated.load(std::memory_order_relaxed) +
+                          sign * static_cast<int64_t>(block_size(bytes)),
+                      std::memory_order_relaxed);
+      requested.store(requested.load(std::memory_order_relaxed) +
+                          sign * static_cast<int64_t>(bytes),
+                      std::memory_order_relaxed);
+    }
+
+    std::array<std::vector<void *>, no_classes> magazines;
+    std::atomic<int64_t> allocated{0};
+    std::atomic<int64_t> requested{0};
+  };
+
+  struct alignas(64) Central {
+    std::mutex mtx; // lock for free and the slab being carved
+    std::vector<void *> free;
+    char *carve = nullptr;
+    size_t carve_left = 0;
+  };
+
+  struct Registry {
+    std::array<Central, no_classes> classes;
+    std::mutex mtx; // lock for the fields below
+    std::vector<Cache *> caches;
+    int64_t exited_allocated = 0;
+    int64_t exited_requested = 0;
+    size_t slab_bytes = 0;
+  };
+
+  // never freed, like the slabs; detached threads may still exit after main
+  static auto registry() -> Registry & {
+    static auto *reg = new Registry;
+    return *reg;
+  }
+
+  static auto local() -> Cache & {
+    thread_local Cache cache;
+    return cache;
+  }
+
+  static inline std::atomic<size_t> reserved_large{0};
+
+  // half a magazine from the free list, or carved from the class's slab
+  static void refill(size_t size_class, std::vector<void *> *magazine) {
+    auto &reg = registry();
+    auto &central = reg.classes[size_class];
+    auto size = class_size(size_class);
+    std::lock_guard<std::mutex> l(central.mtx);
+    while (magazine->size() < magazine_size / 2 && !central.free.empty()) {
+      magazine->push_back(central.free.back());
+      central.free.pop_back();
+    }
+    while (magazine->size() < magazine_size / 2) {
+      if (central.carve_left < size) {
+        central.carve = static_cast<char *>(::operator new(slab_bytes));
+        central.carve_left = slab_bytes;
+        std::lock_guard<std::mutex> reg_l(reg.mtx);
+        reg.slab_bytes += slab_bytes;
+      }
+      magazine->push_back(central.carve);
+      central.carve += size;
+      central.carve_left -= size;
+    }
+  }
+
+  static void drain(size_t size_class, std::vector<void *> *magazine,
+                    size_t count) {
+    auto &central = registry().classes[size_class];
+    std::lock_guard<std::mutex> l(central.mtx);
+    for (size_t i = 0; i < count; i++) {
+      central.free.push_back(magazine->back());
+      magazine->pop_back();
+    }
+  }
+};
+
+inline SlabAllocator::Cache::Cache() {
+  for (auto &magazine : magazines) {
+    magazine.reserve(magazine_size);
+  }
+  auto &reg = registry();
+  std::lock_guard<std::mutex> l(reg.mtx);
+  reg.caches.push_back(this);
+}
+
+inline SlabAllocator::Cache::~Cache() {
+  for (size_t i = 0; i < no_classes; i++) {
+    drain(i, &magazines[i], magazines[i].size());
+  }
+  auto &reg = registry();
+  std::lock_guard<std::mutex> l(reg.mtx);
+  std::erase(reg.caches, this);
+  reg.exited_allocated += allocated.load(std::memory_order_relaxed);
+  reg.exited_requested += requested.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,446 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include "uring_loop.h"
+#include "shared.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fmt/printf.h>
+#include <iostream>
+
+static constexpr unsigned ring_entries = 256;
+static constexpr unsigned nb_buffers = 256; // power of 2
+static constexpr unsigned buffer_size = 4096;
+static constexpr uint16_t buffer_group = 0;
+
+static auto io_uring_setup(unsigned entries, io_uring_params *params) -> int
+{
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static auto io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) -> int
+{
+	return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static auto io_uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args) -> int
+{
+	return static_cast<int>(syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+static auto user_data(uint64_t op, int fd) -> uint64_t
+{
+	return (op << 32) | static_cast<uint32_t>(fd);
+}
+
+auto UringLoop::supported() -> bool
+{
+	// multishot recv (6.0) is the newest feature we rely on, and before it a
+	// kernel only turns it down on the first recv: try one on a socketpair
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+		return false;
+	bool ok = false;
+	{
+		UringLoop probe;
+		ok = probe.probe_recv(fds[0], fds[1]);
+	}
+	close(fds[1]);
+	return ok;
+}
+
+auto UringLoop::probe_recv(int fd, int peer_fd) -> bool
+{
+	auto [it, inserted] = connections.try_emplace(fd, fd);
+	if (!setup_ring(4) || !setup_buffers())
+		return false;
+	arm_recv(it->second);
+	if (write(peer_fd, "x", 1) != 1)
+		return false;
+
+	auto to_submit = sq_local_tail - *sq_tail;
+	__atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+	int entered = -1;
+	while ((entered = io_uring_enter(ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS)) == -1 && errno == EINTR)
+		to_submit = 0;
+	if (entered == -1 || *cq_head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+	auto const &cqe = cqes[*cq_head & cq_mask];
+	return cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE) != 0;
+}
+
+UringLoop::UringLoop(int listen_fd, frame_handler handler, commit_handler commit)
+	: listen_fd(listen_fd), handler(std::move(handler)), commit(std::move(commit))
+{
+	if (!setup_ring(ring_entries) || !setup_buffers())
+	{
+		fmt::print("io_uring setup\n");
+		std::cout << "Errno: " << errno << std::endl;
+		exit(1);
+	}
+}
+
+UringLoop::~UringLoop()
+{
+	for (auto &[fd, uconn] : connections)
+		close_socket(fd, 0);
+	close_socket(listen_fd, 0);
+	close(ring_fd);
+	if (buf_ring != nullptr)
+		munmap(buf_ring, buf_ring_size);
+	if (sqes != nullptr)
+		munmap(sqes, sqes_size);
+	if (cq_ring != nullptr && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	if (sq_ring != nullptr)
+		munmap(sq_ring, sq_ring_size);
+}
+
+auto UringLoop::setup_ring(unsigned entries) -> bool
+{
+	// only this thread submits; completions are reaped when we wait anyway
+	io_uring_params params{};
+	params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	if ((ring_fd = io_uring_setup(entries, &params)) == -1 && errno == EINVAL)
+	{
+		params = io_uring_params{};
+		ring_fd = io_uring_setup(entries, &params);
+	}
+	if (ring_fd == -1)
+		return false;
+
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap)
+		sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+	sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+	{
+		sq_ring = nullptr;
+		return false;
+	}
+	cq_ring = single_mmap ? sq_ring : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	if (cq_ring == MAP_FAILED)
+	{
+		cq_ring = nullptr;
+		return false;
+	}
+	sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+	if (sqes == MAP_FAILED)
+	{
+		sqes = nullptr;
+		return false;
+	}
+
+	auto *sq = static_cast<char *>(sq_ring);
+	sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	sq_entries = params.sq_entries;
+	sq_local_tail = *sq_tail;
+	// SQE slots map 1:1 to the index array
+	for (unsigned i = 0; i < sq_entries; i++)
+		sq_array[i] = i;
+
+	auto *cq = static_cast<char *>(cq_ring);
+	cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+	return true;
+}
+
+auto UringLoop::setup_buffers() -> bool
+{
+	buf_ring_size = nb_buffers * sizeof(io_uring_buf);
+	void *mem = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (mem == MAP_FAILED)
+		return false;
+	buf_ring = static_cast<io_uring_buf_ring *>(mem);
+
+	io_uring_buf_reg reg{};
+	reg.ring_addr = reinterpret_cast<uint64_t>(mem);
+	reg.ring_entries = nb_buffers;
+	reg.bgid = buffer_group;
+	if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		return false;
+
+	buffers = std::make_unique<char[]>(static_cast<size_t>(nb_buffers) * buffer_size);
+	for (unsigned bid = 0; bid < nb_buffers; bid++)
+		recycle_buffer(static_cast<uint16_t>(bid));
+	return true;
+}
+
+auto UringLoop::get_sqe() -> io_uring_sqe *
+{
+	if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+		submit_and_wait(0);
+
+	auto *sqe = &sqes[sq_local_tail & sq_mask];
+	std::memset(sqe, 0, sizeof(*sqe));
+	sq_local_tail++;
+	return sqe;
+}
+
+void UringLoop::submit_and_wait(unsigned wait_nr)
+{
+	auto to_submit = sq_local_tail - *sq_tail;
+	__atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+	while (io_uring_enter(ring_fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0) == -1)
+	{
+		if (errno == EINTR)
+		{
+			to_submit = 0;
+			continue;
+		}
+		fmt::print("io_uring_enter\n");
+		std::cout << "Errno: " << errno << std::endl;
+		exit(1);
+	}
+}
+
+void UringLoop::recycle_buffer(uint16_t bid)
+{
+	// not buf_ring->bufs: in C++ the kernel's flex array macro adds an empty
+	// struct in front of it and shifts the entries by one byte
+	auto &buf = reinterpret_cast<io_uring_buf *>(buf_ring)[buf_tail & (nb_buffers - 1)];
+	buf.addr = reinterpret_cast<uint64_t>(buffers.get() + static_cast<size_t>(bid) * buffer_size);
+	buf.len = buffer_size;
+	buf.bid = bid;
+	buf_tail++;
+	__atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+void UringLoop::arm_accept()
+{
+	auto *sqe = get_sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listen_fd;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	if (multishot_accept)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = user_data(op_accept, listen_fd);
+}
+
+void UringLoop::arm_recv(UringConnection &uconn)
+{
+	auto *sqe = get_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = uconn.conn.fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = buffer_group;
+	if (multishot_recv)
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = user_data(op_recv, uconn.conn.fd);
+	uconn.recv_armed = true;
+	uconn.recv_multishot = multishot_recv;
+}
+
+void UringLoop::submit_send(UringConnection &uconn)
+{
+	if (uconn.send_in_flight)
+		return;
+
+	// the previous batch is out: the replies queued meanwhile become the next
+	if (uconn.sending.empty())
+	{
+		if (uconn.conn.out.empty() || uconn.replies_pending)
+			return;
+		uconn.sending.swap(uconn.conn.out);
+	}
+
+	uconn.msg = {};
+	uconn.msg.msg_iov = uconn.iov.data();
+	uconn.msg.msg_iovlen = uconn.sending.gather(uconn.iov.data(), uconn.iov.size());
+
+	auto *sqe = get_sqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = uconn.conn.fd;
+	sqe->addr = reinterpret_cast<uint64_t>(&uconn.msg);
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = user_data(op_send, uconn.conn.fd);
+	uconn.send_in_flight = true;
+}
+
+void UringLoop::run()
+{
+	arm_accept();
+
+	while (true)
+	{
+		submit_and_wait(1);
+
+		unsigned head = *cq_head;
+		unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			io_uring_cqe cqe = cqes[head & cq_mask];
+			auto op = cqe.user_data >> 32;
+			int fd = static_cast<int>(cqe.user_data & 0xFFFFFFFF);
+
+			if (op == op_accept)
+			{
+				on_accept(cqe);
+				continue;
+			}
+
+			auto it = connections.find(fd);
+			if (it == connections.end())
+				continue;
+			if (op == op_recv)
+				on_recv(it->second, cqe);
+			else if (op == op_send)
+				on_send(it->second, cqe);
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+		send_replied();
+	}
+}
+
+void UringLoop::on_accept(io_uring_cqe const &cqe)
+{
+	if (cqe.res >= 0)
+	{
+		int opt = 1;
+		setsockopt(cqe.res, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+		auto [it, inserted] = connections.try_emplace(cqe.res, cqe.res);
+		arm_recv(it->second);
+	}
+	else if (cqe.res == -EINVAL && multishot_accept)
+	{
+		// supported() let a kernel through that turns it down after all
+		fmt::print("io_uring: multishot accept is not supported by this kernel, accepting one at a time\n");
+		multishot_accept = false;
+	}
+	else
+	{
+		fmt::print("accept ");
+		std::cout << "Errno: " << -cqe.res << std::endl;
+	}
+
+	if ((cqe.flags & IORING_CQE_F_MORE) == 0)
+		arm_accept();
+}
+
+void UringLoop::on_recv(UringConnection &uconn, io_uring_cqe const &cqe)
+{
+	if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER) != 0)
+	{
+		auto bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		uconn.conn.reader.append(buffers.get() + static_cast<size_t>(bid) * buffer_size, cqe.res);
+		recycle_buffer(bid);
+
+		handled = handled || !uconn.closing;
+		if (!uconn.closing && !uconn.conn.handle_frames(handler))
+			uconn.closing = true;
+		else if (!uconn.replies_pending)
+		{
+			// sent by send_replied() at the end of the round
+			uconn.replies_pending = true;
+			replied.push_back(uconn.conn.fd);
+		}
+	}
+
+	if ((cqe.flags & IORING_CQE_F_MORE) == 0)
+	{
+		uconn.recv_armed = false;
+		// -ENOBUFS: every provided buffer was in use, they are back by now
+		bool rearm = cqe.res > 0 || cqe.res == -ENOBUFS;
+		if (cqe.res == -EINVAL && uconn.recv_multishot)
+		{
+			if (multishot_recv)
+				fmt::print("io_uring: multishot recv is not supported by this kernel, receiving one buffer at a time\n");
+			multishot_recv = false;
+			rearm = true;
+		}
+		if (rearm && !uconn.closing)
+			arm_recv(uconn);
+		else
+			uconn.closing = true;
+	}
+
+	if (uconn.closing)
+		close_when_idle(uconn);
+}
+
+void UringLoop::on_send(UringConnection &uconn, io_uring_cqe const &cqe)
+{
+	uconn.send_in_flight = false;
+	if (cqe.res < 0)
+	{
+		uconn.closing = true;
+		uconn.sending = OutputQueue{};
+	}
+	else
+	{
+		uconn.sending.consume(cqe.res);
+		submit_send(uconn);
+	}
+
+	if (uconn.closing)
+		close_when_idle(uconn);
+}
+
+void UringLoop::send_replied()
+{
+	if (replied.empty() && !handled)
+		return;
+	handled = false;
+
+	bool committed = !commit || commit();
+	for (int fd : replied)
+	{
+		auto it = connections.find(fd);
+		if (it == connections.end() || !it->second.replies_pending)
+			continue;
+		auto &uconn = it->second;
+		uconn.replies_pending = false;
+		bool dropped = !committed && uconn.conn.awaits_commit;
+		uconn.conn.awaits_commit = false;
+		if (!dropped)
+		{
+			submit_send(uconn);
+			// e.g. the EOF came with the last frames, see close_when_idle()
+			if (uconn.closing)
+				close_when_idle(uconn);
+			continue;
+		}
+		uconn.conn.out = OutputQueue{};
+		uconn.closing = true;
+		close_when_idle(uconn);
+	}
+	replied.clear();
+}
+
+void UringLoop::close_when_idle(UringConnection &uconn)
+{
+	int fd = uconn.conn.fd;
+	// send_replied() comes back once the replies of the round are committed
+	if (uconn.replies_pending)
+		return;
+	if (uconn.recv_armed)
+	{
+		// completes the armed multishot recv, we come back on its last CQE
+		shutdown(fd, SHUT_RDWR);
+		return;
+	}
+	if (uconn.send_in_flight)
+		return;
+
+	connections.erase(fd);
+	close_socket(fd, 0);
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+#include "event_loop.h"
+
+/**
+ ** io_uring counterpart of the EventLoop, with the same framing and frame
+ ** handler. One multishot accept on the listening socket and one multishot
+ ** recv per connection stay armed; received bytes land in a registered ring
+ ** of provided buffers. Every SQE queued while a batch of completions is
+ ** handled goes to the kernel with a single io_uring_enter() that also
+ ** waits for the next completions.
+ ** It needs Linux 6.0 or newer (multishot recv), which supported() checks
+ ** with a recv on a socketpair. Should a kernel still turn multishot accept
+ ** or recv down, the loop goes on with one-shot ones.
+ **/
+class UringLoop {
+public:
+  UringLoop(int listen_fd, frame_handler handler, commit_handler commit = {});
+  ~UringLoop();
+
+  UringLoop(UringLoop const &) = delete;
+  auto operator=(UringLoop const &) -> UringLoop & = delete;
+
+  // whether io_uring with provided buffer rings and multishot recv is
+  // usable on this kernel
+  static auto supported() -> bool;
+
+  [[noreturn]] void run();
+
+private:
+  struct UringConnection {
+    explicit UringConnection(int fd) : conn(fd) {}
+
+    Connection conn;
+    OutputQueue sending; // owned by the in-flight SQE until it completes
+    std::array<iovec, 64> iov{};
+    msghdr msg{};
+    bool recv_armed = false;
+    bool recv_multishot = false; // of the armed recv
+    bool send_in_flight = false;
+    bool replies_pending = false; // out holds replies not committed yet
+    bool closing = false;
+  };
+
+  enum op_type : uint64_t { op_accept = 1, op_recv = 2, op_send = 3 };
+
+  // for supported(), owns no listening socket
+  UringLoop() = default;
+  // arms a recv on fd and sends it a byte from peer_fd
+  auto probe_recv(int fd, int peer_fd) -> bool;
+
+  auto setup_ring(unsigned entries) -> bool;
+  auto setup_buffers() -> bool;
+  auto get_sqe() -> io_uring_sqe *;
+  void submit_and_wait(unsigned wait_nr);
+
+  void arm_accept();
+  void arm_recv(UringConnection &uconn);
+  void submit_send(UringConnection &uconn);
+  void recycle_buffer(uint16_t bid);
+
+  void on_accept(io_uring_cqe const &cqe);
+  void on_recv(UringConnection &uconn, io_uring_cqe const &cqe);
+  void on_send(UringConnection &uconn, io_uring_cqe const &cqe);
+  void send_replied();
+  void close_when_idle(UringConnection &uconn);
+
+  int ring_fd = -1;
+  int listen_fd = -1;
+  frame_handler handler;
+  commit_handler commit;
+  std::unordered_map<int, UringConnection> connections;
+  std::vector<int> replied; // connections with frames handled in this round
+  bool handled = false;     // frames in this round, see commit_handler
+  bool multishot_accept = true;
+  bool multishot_recv = true;
+
+  // submission queue
+  void *sq_ring = nullptr;
+  size_t sq_ring_size = 0;
+  unsigned *sq_head = nullptr;
+  unsigned *sq_tail = nullptr;
+  unsigned *sq_array = nullptr;
+  unsigned sq_mask = 0;
+  unsigned sq_entries = 0;
+  unsigned sq_local_tail = 0; // SQEs up to here are filled but not published
+  io_uring_sqe *sqes = nullptr;
+  size_t sqes_size = 0;
+
+  // completion queue
+  void *cq_ring = nullptr;
+  size_t cq_ring_size = 0;
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  io_uring_cqe *cqes = nullptr;
+
+  // registered ring of provided receive buffers
+  io_uring_buf_ring *buf_ring = nullptr;
+  size_t buf_ring_size = 0;
+  std::unique_ptr<char[]> buffers;
+  uint16_t buf_tail = 0;
+};
@@ -0,0 +1,128 @@
+#include <utility>
+
+#include "write_back.h"
+#include "key_codec.h"
+
+#include "rocksdb/write_batch.h"
+#include <fmt/printf.h>
+#include <iostream>
+
+auto parse_durability(std::string_view name) -> std::optional<durability>
+{
+	if (name == "sync")
+		return durability::sync;
+	if (name == "group")
+		return durability::group;
+	if (name == "async")
+		return durability::async;
+	return std::nullopt;
+}
+
+WriteBack::WriteBack(rocksdb::DB &db, durability mode, std::chrono::milliseconds interval, size_t max_dirty_bytes)
+	: db(db), interval(interval), max_dirty_bytes(max_dirty_bytes)
+{
+	write_options.sync = mode == durability::group;
+	flusher = std::thread(&WriteBack::run, this);
+}
+
+WriteBack::~WriteBack()
+{
+	{
+		std::lock_guard<std::mutex> l(dirty_mtx);
+		stopping = true;
+	}
+	flush_needed.notify_one();
+	flusher.join();
+	fmt::print("[{}] flushes={} flushed_keys={}\n", __func__, no_flushes, no_flushed_keys);
+}
+
+void WriteBack::put(int key, std::string_view value)
+{
+	std::lock_guard<std::mutex> l(dirty_mtx);
+	if (dirty.empty())
+		oldest_dirty = std::chrono::steady_clock::now();
+
+	auto [it, inserted] = dirty.try_emplace(key);
+	auto bytes = dirty_bytes.load(std::memory_order_relaxed) + value.size() - it->second.size();
+	it->second.assign(value.data(), value.size());
+	dirty_bytes.store(bytes, std::memory_order_relaxed);
+
+	if (bytes >= max_dirty_bytes)
+		flush_needed.notify_one();
+}
+
+auto WriteBack::get(int key, std::string *value) const -> bool
+{
+	std::lock_guard<std::mutex> l(dirty_mtx);
+	for (auto const *keys : {&dirty, &draining})
+	{
+		if (auto it = keys->find(key); it != keys->end())
+		{
+			value->assign(it->second);
+			return true;
+		}
+	}
+	return false;
+}
+
+void WriteBack::flush()
+{
+	std::lock_guard<std::mutex> flush_lock(flush_mtx);
+	std::chrono::steady_clock::time_point oldest;
+	size_t bytes = 0;
+	{
+		std::lock_guard<std::mutex> l(dirty_mtx);
+		if (dirty.empty())
+			return;
+		// still visible to get() until RocksDB has them
+		draining.swap(dirty);
+		oldest = oldest_dirty;
+	}
+
+	rocksdb::WriteBatch write_batch;
+	for (auto const &[key, value] : draining)
+	{
+		write_batch.Put(EncodedKey(key), value);
+		bytes += value.size();
+	}
+
+	rocksdb::Status rock_s = db.Write(write_options, &write_batch);
+	auto lag = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - oldest);
+
+	std::lock_guard<std::mutex> l(dirty_mtx);
+	if (!rock_s.ok())
+	{
+		fmt::print("\nFLUSH Errrrrrrrrrrrrrrrrrrror:\n");
+		std::cerr << rock_s.ToString() << std::endl;
+		// retried with the next flush, unless written again meanwhile
+		for (auto &[key, value] : draining)
+			if (dirty.try_emplace(key, std::move(value)).second)
+				bytes -= dirty[key].size();
+		if (!dirty.empty())
+			oldest_dirty = oldest;
+	}
+	else
+	{
+		no_flushes++;
+		no_flushed_keys += draining.size();
+		fmt::print("FLUSH < {} keys, {} bytes, lag {} ms, {} bytes still dirty >\n",
+				   draining.size(), bytes, lag.count(), dirty_bytes.load(std::memory_order_relaxed) - bytes);
+	}
+	dirty_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+	draining.clear();
+}
+
+void WriteBack::run()
+{
+	std::unique_lock<std::mutex> l(dirty_mtx);
+	while (!stopping)
+	{
+		flush_needed.wait_for(l, interval, [this]
+							  { return stopping || dirty_bytes.load(std::memory_order_relaxed) >= max_dirty_bytes; });
+		l.unlock();
+		flush();
+		l.lock();
+	}
+	l.unlock();
+	flush();
+}
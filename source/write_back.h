@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#include "rocksdb/db.h"
+
+/**
+ ** When a PUT is acknowledged relative to its RocksDB write:
+ **  - sync:  after the write is synced to disk, see GroupCommit (the default)
+ **  - group: after the KvStore update; the flusher persists the dirty keys
+ **           in WriteBatches that are synced to disk
+ **  - async: like group but without waiting for the WAL to reach the disk
+ **/
+enum class durability { sync, group, async };
+
+auto parse_durability(std::string_view name) -> std::optional<durability>;
+
+/**
+ ** Dirty keys waiting for the background flusher. Every interval, or as soon
+ ** as max_dirty_bytes are dirty, the flusher drains them into one RocksDB
+ ** WriteBatch. A key written several times in between is written once, with
+ ** its latest value.
+ **/
+class WriteBack {
+public:
+  WriteBack(rocksdb::DB &db, durability mode, std::chrono::milliseconds interval,
+            size_t max_dirty_bytes);
+  ~WriteBack();
+
+  WriteBack(WriteBack const &) = delete;
+  auto operator=(WriteBack const &) -> WriteBack & = delete;
+
+  void put(int key, std::string_view value);
+
+  // the value of a key that is not persisted yet
+  auto get(int key, std::string *value) const -> bool;
+
+  // drains the dirty keys now, from the calling thread
+  void flush();
+
+  [[nodiscard]] auto get_dirty_bytes() const -> size_t {
+    return dirty_bytes.load(std::memory_order_relaxed);
+  }
+
+private:
+  void run();
+
+  rocksdb::DB &db;
+  rocksdb::WriteOptions write_options;
+  std::chrono::milliseconds interval;
+  size_t max_dirty_bytes;
+
+  mutable std::mutex dirty_mtx; // lock for dirty, draining and oldest_dirty
+  std::condition_variable flush_needed;
+  std::unordered_map<int, std::string> dirty;
+  std::unordered_map<int, std::string> draining; // being written by flush()
+  std::chrono::steady_clock::time_point oldest_dirty;
+  std::atomic<size_t> dirty_bytes{0};
+
+  std::mutex flush_mtx; // one drain at a time, in order
+  uint64_t no_flushes = 0;
+  uint64_t no_flushed_keys = 0;
+
+  bool stopping = false;
+  std::thread flusher;
+};
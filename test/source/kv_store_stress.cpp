@@ -0,0 +1,239 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/printf.h>
+
+#include "epoch.h"
+#include "kv_store.h"
+
+namespace
+{
+	constexpr int no_keys = 40000;
+	constexpr int no_rounds = 20;
+	constexpr int no_writers = 2;
+	constexpr int no_readers = 2;
+
+	// what round writes to key: one letter repeated, 8 to 107 bytes
+	auto value_of(int key, int round) -> std::string
+	{
+		return std::string(8 + (key + round) % 100, static_cast<char>('a' + round % 26));
+	}
+
+	auto is_whole(std::string const &value) -> bool
+	{
+		if (value.size() < 8 || value.size() > 107)
+			return false;
+		for (auto c : value)
+			if (c != value[0])
+				return false;
+		return true;
+	}
+
+	/**
+	 ** The writers overwrite every key once per round, so the stripes grow
+	 ** and retire blocks and slot arrays all along, while the readers get
+	 ** random keys without a lock. A value that is read must be one some
+	 ** round wrote, never a mix of two or freed bytes.
+	 **/
+	bool stress_kv_store()
+	{
+		auto kv = KvStore::init();
+		std::atomic<bool> stop{false};
+		std::atomic<long> no_torn{0};
+		std::atomic<long> no_hits{0};
+
+		std::vector<std::thread> writers;
+		for (int w = 0; w < no_writers; w++)
+			writers.emplace_back([&, w]
+								 {
+				for (int round = 0; round < no_rounds; round++)
+					for (int key = w; key < no_keys; key += no_writers)
+						kv->put(key, value_of(key, round)); });
+
+		std::vector<std::thread> readers;
+		for (int r = 0; r < no_readers; r++)
+			readers.emplace_back([&, r]
+								 {
+				std::string value;
+				uint32_t x = r + 1;
+				while (!stop.load(std::memory_order_relaxed))
+				{
+					x = x * 1664525 + 1013904223;
+					if (!kv->get(static_cast<int>(x % no_keys), &value))
+						continue;
+					no_hits.fetch_add(1, std::memory_order_relaxed);
+					if (!is_whole(value))
+						no_torn.fetch_add(1, std::memory_order_relaxed);
+				} });
+
+		for (auto &t : writers)
+			t.join();
+		stop = true;
+		for (auto &t : readers)
+			t.join();
+
+		long no_stale = 0;
+		std::string value;
+		for (int key = 0; key < no_keys; key++)
+			if (!kv->get(key, &value) || value != value_of(key, no_rounds - 1))
+				no_stale++;
+
+		fmt::print("[{}] hits={} torn={} stale={}\n", __func__, no_hits.load(), no_torn.load(), no_stale);
+		return no_torn == 0 && no_stale == 0;
+	}
+
+	/**
+	 ** The same writers and readers on a store with a byte limit well below
+	 ** the keys, so that every stripe evicts all along, then erase and put
+	 ** churn on a few keys. The store must stay within its limit, counting
+	 ** the eviction queues, and a key that is still there must hold the
+	 ** value of the last round: eviction never brings an older one back.
+	 **/
+	bool bounded_store_stays_in_budget()
+	{
+		constexpr size_t cache_bytes = 2 * 1024 * 1024;
+		auto kv = KvStore::init(cache_bytes);
+		std::atomic<bool> stop{false};
+		std::atomic<long> no_torn{0};
+
+		std::vector<std::thread> writers;
+		for (int w = 0; w < no_writers; w++)
+			writers.emplace_back([&, w]
+								 {
+				for (int round = 0; round < no_rounds; round++)
+					for (int key = w; key < no_keys; key += no_writers)
+						kv->put(key, value_of(key, round)); });
+
+		std::vector<std::thread> readers;
+		for (int r = 0; r < no_readers; r++)
+			readers.emplace_back([&, r]
+								 {
+				std::string value;
+				uint32_t x = r + 1;
+				while (!stop.load(std::memory_order_relaxed))
+				{
+					x = x * 1664525 + 1013904223;
+					if (kv->get(static_cast<int>(x % no_keys), &value) && !is_whole(value))
+						no_torn.fetch_add(1, std::memory_order_relaxed);
+				} });
+
+		for (auto &t : writers)
+			t.join();
+		stop = true;
+		for (auto &t : readers)
+			t.join();
+
+		long no_stale = 0, no_present = 0;
+		std::string value;
+		for (int key = 0; key < no_keys; key++)
+		{
+			if (!kv->get(key, &value))
+				continue;
+			no_present++;
+			if (value != value_of(key, no_rounds - 1))
+				no_stale++;
+		}
+		auto after_rounds = kv->resident_bytes();
+
+		for (int round = 0; round < 200; round++)
+			for (int key = 0; key < 500; key++)
+			{
+				kv->erase(key);
+				kv->put(key, value_of(key, round));
+			}
+		auto after_churn = kv->resident_bytes();
+
+		fmt::print("[{}] present={} evicted={} torn={} stale={} resident after rounds={} after churn={} limit={}\n",
+				   __func__, no_present, kv->evictions(), no_torn.load(), no_stale, after_rounds, after_churn,
+				   cache_bytes);
+		return no_torn == 0 && no_stale == 0 && kv->evictions() > 0 && after_rounds <= cache_bytes &&
+			   after_churn <= cache_bytes;
+	}
+
+	/**
+	 ** A hot set that is read now and then, next to a scan that writes ten
+	 ** times the limit in keys that are never read again. The scan only
+	 ** washes through the small FIFO; the hot keys stay.
+	 **/
+	bool hot_set_survives_scan()
+	{
+		constexpr size_t cache_bytes = 1024 * 1024;
+		constexpr int no_hot = 1000;
+		constexpr int no_scanned = 100000;
+		auto kv = KvStore::init(cache_bytes);
+		std::string value;
+
+		for (int key = 0; key < no_hot; key++)
+			kv->put(key, value_of(key, 0));
+		for (int key = no_hot; key < no_hot + no_scanned; key++)
+		{
+			if (key % no_hot == 0)
+				for (int hot = 0; hot < no_hot; hot++)
+					kv->get(hot, &value);
+			kv->put(key, value_of(key, 0));
+		}
+
+		int no_kept = 0;
+		for (int key = 0; key < no_hot; key++)
+			no_kept += kv->get(key, &value) ? 1 : 0;
+
+		fmt::print("[{}] hot keys kept={} of {} evicted={} resident={} limit={}\n", __func__, no_kept, no_hot,
+				   kv->evictions(), kv->resident_bytes(), cache_bytes);
+		return no_kept >= no_hot * 95 / 100 && kv->resident_bytes() <= cache_bytes;
+	}
+
+	std::atomic<int> no_freed{0};
+
+	void counted_free(void *ptr)
+	{
+		delete static_cast<int *>(ptr);
+		no_freed.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	/**
+	 ** Counts the frees of what was retired while another thread held a
+	 ** guard: none until the guard is gone, all of them two epochs after.
+	 ** With an immediate free instead of retire(), the readers above would
+	 ** touch freed blocks.
+	 **/
+	bool guard_holds_back_frees()
+	{
+		constexpr int no_retired = 640;
+		std::atomic<bool> pinned{false};
+		std::atomic<bool> release{false};
+
+		std::thread reader([&]
+						   {
+			Epoch::Guard guard;
+			pinned = true;
+			while (!release)
+				std::this_thread::yield(); });
+		while (!pinned)
+			std::this_thread::yield();
+
+		for (int i = 0; i < no_retired; i++)
+			Epoch::retire(new int(i), counted_free);
+		auto freed_while_pinned = no_freed.load();
+
+		release = true;
+		reader.join();
+		// every 64th retire tries to advance the epoch and free
+		for (int i = 0; i < 3 * 64; i++)
+			Epoch::retire(new int(i));
+		auto freed_after = no_freed.load();
+
+		fmt::print("[{}] retired={} freed while pinned={} freed after={}\n", __func__, no_retired, freed_while_pinned, freed_after);
+		return freed_while_pinned == 0 && freed_after == no_retired;
+	}
+} // namespace
+
+int main()
+{
+	bool ok = stress_kv_store();
+	ok = bounded_store_stays_in_budget() && ok;
+	ok = hot_set_survives_scan() && ok;
+	ok = guard_holds_back_frees() && ok;
+	return ok ? 0 : 1;
+}
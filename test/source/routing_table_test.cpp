@@ -0,0 +1,109 @@
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <fmt/printf.h>
+
+#include "routing_table.h"
+
+namespace
+{
+	// the same cluster, epoch, shards and owner for every bucket
+	bool same_table(RoutingTable const &a, RoutingTable const &b)
+	{
+		if (a.cluster() != b.cluster() || a.epoch() != b.epoch() || a.ports() != b.ports())
+			return false;
+		for (uint32_t bucket = 0; bucket < BucketMap::no_buckets; bucket++)
+			if (a.buckets().owner_of_bucket(bucket) != b.buckets().owner_of_bucket(bucket))
+				return false;
+		return true;
+	}
+
+	/**
+	 ** Goes through joins, a leave and hot bucket moves on the master's
+	 ** table, and keeps a client copy of every epoch. Whatever to_message()
+	 ** sends for the epoch of a copy, moves or the whole table, must bring
+	 ** that copy to the master's table.
+	 **/
+	bool copies_catch_up()
+	{
+		RoutingTable master(42);
+		std::vector<RoutingTable> copies{RoutingTable{}};
+		auto changed = [&master, &copies]
+		{ copies.push_back(master); };
+
+		for (int port : {1026, 1027, 1028})
+		{
+			master.add(port);
+			changed();
+		}
+		master.remove(1027);
+		changed();
+		master.add(1029);
+		changed();
+		// more epochs than the master remembers
+		for (uint32_t round = 0; round < RoutingTable::max_history + 2; round++)
+		{
+			std::vector<std::pair<uint32_t, int>> hot;
+			for (uint32_t bucket = round * 7; bucket < round * 7 + 5; bucket++)
+				hot.emplace_back(bucket, bucket % 2 == 0 ? 1029 : 1028);
+			master.assign(hot);
+			changed();
+		}
+
+		int no_failed = 0, no_moves = 0, no_whole = 0;
+		for (auto const &copy : copies)
+		{
+			sockets::client_msg::RoutingTable message;
+			if (copy.cluster() == master.cluster())
+				master.to_message(&message, copy.epoch());
+			else
+				master.to_message(&message);
+			(message.has_base_epoch() ? no_moves : no_whole)++;
+
+			auto updated = copy;
+			if (!updated.update(message) || !same_table(updated, master))
+			{
+				fmt::print("[{}] the copy of epoch {} did not catch up with epoch {}\n", __func__, copy.epoch(),
+						   master.epoch());
+				no_failed++;
+			}
+		}
+
+		fmt::print("[{}] copies={} by moves={} whole={} failed={}\n", __func__, copies.size(), no_moves, no_whole,
+				   no_failed);
+		return no_failed == 0 && no_moves > 0 && no_whole > 0;
+	}
+
+	// moves meant for another cluster's epochs are turned down
+	bool other_cluster_is_refused()
+	{
+		RoutingTable master(42);
+		RoutingTable other(7);
+		for (int port : {1026, 1027})
+		{
+			master.add(port);
+			other.add(port + 4);
+		}
+		// few enough moves to go out as such
+		master.assign({{5, 1027}});
+
+		sockets::client_msg::RoutingTable message;
+		master.to_message(&message, other.epoch());
+		auto refused = message.has_base_epoch() && !other.update(message);
+
+		message.Clear();
+		master.to_message(&message);
+		auto replaced = other.update(message) && same_table(other, master);
+
+		fmt::print("[{}] refused={} replaced={}\n", __func__, refused, replaced);
+		return refused && replaced;
+	}
+} // namespace
+
+int main()
+{
+	bool ok = copies_catch_up();
+	ok = other_cluster_is_refused() && ok;
+	return ok ? 0 : 1;
+}
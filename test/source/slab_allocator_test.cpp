@@ -0,0 +1,108 @@
+#include <bit>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#include <fmt/printf.h>
+
+#include "epoch.h"
+#include "slab_allocator.h"
+
+namespace
+{
+	constexpr size_t block_bytes = 100;
+	constexpr int no_blocks = 4096;
+
+	/**
+	 ** The size classes at their edges: 16 bytes apart up to 128, eighths
+	 ** of the power of two above, nothing past 4 KiB. In between a block
+	 ** is never smaller than asked and wastes less than a class step.
+	 **/
+	bool classes_fit()
+	{
+		struct Edge
+		{
+			size_t bytes;
+			size_t block;
+		};
+		int no_failed = 0;
+		for (auto [bytes, block] : {Edge{0, 16}, Edge{1, 16}, Edge{16, 16}, Edge{17, 32}, Edge{128, 128}, Edge{129, 144},
+									Edge{256, 256}, Edge{257, 288}, Edge{4096, 4096}, Edge{4097, 4097}})
+		{
+			if (SlabAllocator::block_size(bytes) != block)
+			{
+				fmt::print("[{}] {} bytes take {}, not {}\n", __func__, bytes, SlabAllocator::block_size(bytes), block);
+				no_failed++;
+			}
+		}
+
+		for (size_t bytes = 1; bytes <= 4096; bytes++)
+		{
+			auto block = SlabAllocator::block_size(bytes);
+			auto step = bytes <= 128 ? size_t{16} : std::bit_ceil(bytes) / 16;
+			if (block < bytes || block - bytes >= step || block < SlabAllocator::block_size(bytes - 1))
+			{
+				fmt::print("[{}] {} bytes take {}\n", __func__, bytes, block);
+				no_failed++;
+			}
+		}
+
+		fmt::print("[{}] failed={}\n", __func__, no_failed);
+		return no_failed == 0;
+	}
+
+	void free_block(void *block) { SlabAllocator::deallocate(block, block_bytes); }
+
+	/**
+	 ** Blocks allocated on one thread and retired on another, which frees
+	 ** them through the epoch collector into its own magazines. The stats
+	 ** sum up the counters of both threads, and the blocks are reused
+	 ** afterwards instead of new slabs.
+	 **/
+	bool cross_thread_frees()
+	{
+		auto before = SlabAllocator::stats();
+
+		std::vector<void *> blocks;
+		for (int i = 0; i < no_blocks; i++)
+			blocks.push_back(SlabAllocator::allocate(block_bytes));
+		auto *large = SlabAllocator::allocate(5000);
+		auto in_use = SlabAllocator::stats();
+
+		std::thread collector([&blocks]
+							  {
+			for (auto *block : blocks)
+				Epoch::retire(block, free_block);
+			// every 64th retire tries to advance the epoch and free
+			for (int i = 0; i < 3 * 64; i++)
+				Epoch::retire(new int(i)); });
+		collector.join();
+		SlabAllocator::deallocate(large, 5000);
+		auto freed = SlabAllocator::stats();
+
+		for (auto &block : blocks)
+			block = SlabAllocator::allocate(block_bytes);
+		auto reused = SlabAllocator::stats();
+		for (auto *block : blocks)
+			SlabAllocator::deallocate(block, block_bytes);
+
+		auto allocated = in_use.allocated - before.allocated;
+		auto requested = in_use.requested - before.requested;
+		bool counted = allocated == no_blocks * SlabAllocator::block_size(block_bytes) + 5000 &&
+					   requested == no_blocks * block_bytes + 5000 && in_use.reserved >= in_use.allocated;
+		bool returned = freed.allocated == before.allocated && freed.requested == before.requested &&
+						freed.reserved == in_use.reserved - 5000;
+		bool no_new_slabs = reused.reserved == freed.reserved;
+
+		fmt::print("[{}] allocated={} requested={} reserved={} counted={} returned={} reused without new slabs={}\n",
+				   __func__, allocated, requested, in_use.reserved - before.reserved, counted, returned, no_new_slabs);
+		return counted && returned && no_new_slabs;
+	}
+} // namespace
+
+int main()
+{
+	bool ok = classes_fit();
+	ok = cross_thread_frees() && ok;
+	return ok ? 0 : 1;
+}
@@ -4,6 +4,7 @@ import sys
 import subprocess
 import time
 import psutil
+from typing import Tuple
 
 from testsupport import (
     run_project_executable,
@@ -42,6 +43,25 @@ def run_client(port: int, operation: str, key: int, value: int, master_port: int
 
         return ret
 
+def run_client_output(port: int, operation: str, key: int, value: int, master_port: int, direct: int) -> Tuple[int, str]:
+    # like run_client, but also hands back what the client printed
+    with tempfile.TemporaryFile(mode="w+") as stdout:
+        proc = run_project_executable(
+            "clt",
+            args=[
+                "-p", str(port),
+                "-o", operation,
+                "-k", str(key),
+                "-v", str(value),
+                "-m", str(master_port),
+                "-d", str(direct),
+            ],
+            stdout=stdout,
+            check=False
+        )
+        stdout.seek(0)
+        return proc.returncode, stdout.read()
+
 def run_master(port: int) -> Popen:
     # master always run with port number 1025
     try:
@@ -1,9 +1,14 @@
 #!/usr/bin/env python3
 
 import sys
+import tempfile
+from pathlib import Path
 from time import sleep
 from testsupport import subtest, info, run
-from socketsupport import run_client, run_master, run_server
+from socketsupport import run_client, run_client_output, run_master, run_server
+
+# where the clients keep their copy of the master's routing table
+ROUTING_CACHE = Path(tempfile.gettempdir()) / "clt-routing-1025"
 
 
 def main() -> None:
@@ -23,7 +28,11 @@ def main() -> None:
                 server_proc_two.terminate()
                 sys.exit(1)
             sleep(3)
-        
+
+        # the clients' table from before the join, which routes the moved
+        # buckets to their old shards
+        stale_table = ROUTING_CACHE.read_bytes()
+
         server_proc_three = run_server(1028, 1025)
         sleep(10)
 
@@ -42,6 +51,29 @@ def main() -> None:
             server_proc_three.terminate()
             sys.exit(-1)
 
+        info(f"Testing redirects from a stale routing table")
+        redirected = False
+        failed = False
+        for i in range(1, 6):
+            ROUTING_CACHE.write_bytes(stale_table)
+            client_ret, output = run_client_output(1026, "GET", i, 1000, 1025, 0)
+            redirected |= "is on" in output
+            failed |= client_ret != 0
+        for i in range(101, 131):
+            ROUTING_CACHE.write_bytes(stale_table)
+            client_ret, output = run_client_output(1026, "PUT", i, 2000, 1025, 0)
+            redirected |= "is on" in output
+            failed |= client_ret != 0
+            # with the table the redirect brought in, from the owner
+            failed |= run_client(1026, "GET", i, 2000, 1025, 0) != 0
+
+        if failed or not redirected:
+            master_proc.terminate()
+            server_proc_one.terminate()
+            server_proc_two.terminate()
+            server_proc_three.terminate()
+            sys.exit(-1)
+
         master_proc.terminate()
         server_proc_one.terminate()
         server_proc_two.terminate()